@@ -30,6 +30,7 @@
 #define GC_UNT 0x5F
 // Address commands
 #define GC_LAD 0x20
+#define GC_SCG 0x60
 // Addressed commands
 #define GC_GTL 0x01
 #define GC_SDC 0x04
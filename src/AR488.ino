@@ -94,6 +94,10 @@ void setup() {
 	controller->serialstream->println("Config init...");
   controller->initConfig();
 	controller->serialstream->println("Config init done");
+#ifdef USE_GPIB_TASK
+  // Run the GPIB transfers on the other core
+  gpib->startTask();
+#endif
 #if defined(USE_MACROS)
   // Run startup macro
 	if (isMacro(0))
@@ -118,7 +122,7 @@ void loop() {
  */
 #ifdef USE_MACROS
   // Run user macro if flagged
-  if (controller->runMacro > 0) {
+  if ((controller->runMacro > 0) && !gpib->xfrBusy()) {
 			execMacro(controller->runMacro, *controller);
     controller->runMacro = 0;
   }
@@ -149,7 +153,17 @@ void loop() {
  */
 
   // lnRdy=1: received a command so execute it...
-  if (controller->lnRdy == 1) {
+  // (once the GPIB transfer in progress is done)
+  if (gpib->xfrBusy()) {
+    // A new line breaks the read when allowed (see xfrBreakable()), the
+    // line being sent does not
+    if ((controller->lnRdy > 0) && gpib->xfrBreakable()) {
+      gpib->tranBrk = 1;
+      controller->aRead = false;
+    }
+    gpib->xfrService();
+  }
+  else if (controller->lnRdy == 1) {
     controller->execCmd();
   }
 #if defined(USE_MACROS)
@@ -158,31 +172,27 @@ void loop() {
   }
 #endif
 
-  // Controller mode:
-  if (controller->config.cmode == 2) {
-    // lnRdy=2: received data - send it to the instrument...
+  // Controller mode (once the GPIB transfer in progress is done):
+  if ((controller->config.cmode == 2) && !gpib->xfrBusy()) {
+    // lnRdy=2: received data - send it to the instrument, then
+    // auto-read data following any command (amode 1) or a query
+    // command (amode 2), without blocking
     if (controller->lnRdy == 2) {
-      controller->sendToInstrument();
-			// Auto-read data from GPIB bus following any command
-      if (controller->config.amode == 1) {
-        gpib->gpibReceiveData();
-      }
-      // Auto-receive data from GPIB bus following a query command
-      if (controller->config.amode == 2 && gpib->isQuery) {
-        gpib->gpibReceiveData();
-        gpib->isQuery = false;
-      }
-			controller->showPrompt();
+      controller->sendToInstrumentNb();
     }
 
-    // Check status of SRQ and SPOLL if asserted
-    if (gpib->isSRQ() && controller->isSrqa) {
-			controller->spoll_h(NULL);
-      gpib->clearSRQ();
+    // Report SRQ events, or check status of SRQ and SPOLL if asserted
+    else if (controller->srqEvt) {
+      controller->srqEvents();
+    } else if (gpib->isSRQ() && controller->srqaMode) {
+			controller->srqService();
+      // Another device may still be requesting service
+      gpib->setSRQ(digitalRead(SRQ) == LOW);
     }
 
-    // Continuous auto-receive data from GPIB bus
-    if (controller->config.amode == 3 && controller->aRead) gpib->gpibReceiveData();
+    // Continuous auto-receive data from GPIB bus (once the lines of the
+    // other sessions have been served, see selectStream())
+    else if (controller->config.amode == 3 && controller->aRead && !controller->linesQueued()) gpib->xfrReceive();
   }
 
   // Device mode:
@@ -208,20 +218,25 @@ void loop() {
 
   // IDN query ?
   if (controller->sendIdn) {
-    if (controller->config.idn==1) controller->cmdstream->println(controller->config.sname);
-    if (controller->config.idn==2) {
-				controller->cmdstream->print(controller->config.sname);
-				controller->cmdstream->print("-");
-				controller->cmdstream->println(controller->config.serial);
-		}
+    controller->idnReply(controller->cmdstream);
     controller->sendIdn = false;
   }
 
 	// look for incoming data on a stream, and make it the current IO stream
 	controller->selectStream();
-  // Check serial buffer
-  controller->serialIn_h();
+  // Check serial buffer (during a transfer: only if the line can break the read)
+  if (!gpib->xfrBusy() || (gpib->xfrBreakable() && (controller->lnRdy == 0))) {
+    controller->serialIn_h();
+  }
 
+#ifdef USE_GPIB_TASK
+  // loop() shares core 0 with the WiFi tasks: sleep for a tick when there
+  // is no line to process, so that the idle task of the core gets to run
+  if (controller->lnRdy == 0) {
+    delay(1);
+    return;
+  }
+#endif
   delayMicroseconds(5);
 }
 /***** END MAIN LOOP *****/
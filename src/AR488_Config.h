@@ -134,8 +134,10 @@
 /*
  * With UNO. NANO and MEGA boards with pre-defined layouts,
  * USE_INTERRUPTS can and should be used.
- * With the AR488_CUSTOM layout and unknown boards, USE_INTERRUPTS must
- * be commented out. Interrupts are used on pre-defined AVR board layouts
+ * With the AR488_CUSTOM layout, USE_INTERRUPTS can be defined (e.g. in
+ * platformio.ini) on boards where the ATN and SRQ pins can be attached
+ * to an interrupt, such as ESP32 and STM32; with unknown boards, it must
+ * be left undefined. Interrupts are used on pre-defined AVR board layouts
  * and will respond faster, however in-loop checking for state of pin states
  * can be supported with any board layout.
  */
@@ -162,6 +164,37 @@
 //#define USE_MACROS    // Enable the macro feature
 
 
+/***** Enable device profiles *****/
+/*
+ * Uncomment to enable per address device profiles. The termination,
+ * EOI, read timeout and bus delay settings can be stored for each
+ * device address with ++profile set, and are then applied in one step
+ * when the device is selected with ++addr. Profiles are saved with
+ * ++savecfg. Uses 8 bytes of RAM (and EEPROM) per address.
+ */
+//#define USE_PROFILES  // Enable device profiles
+
+
+/***** Run the GPIB transfers in a task (dual core ESP32) *****/
+/*
+ * Uncomment to run the non-blocking GPIB transfers (data sent to the
+ * instrument, ++read and the auto mode reads) in a FreeRTOS task pinned
+ * to core 1 (GPIB_TASK_CORE), with a priority (GPIB_TASK_PRIO) above the
+ * one of the idle task. loop() must then run on core 0, with the WiFi
+ * tasks: build with -D ARDUINO_RUNNING_CORE=0 (see platformio.ini). The
+ * received data and the messages are handed back to loop() through a
+ * ring buffer of GPIB_TASK_QSIZE bytes (power of 2). Ignored on single
+ * core boards.
+ */
+//#define USE_GPIB_TASK
+#define GPIB_TASK_CORE 1
+#define GPIB_TASK_PRIO 2
+#define GPIB_TASK_QSIZE 1024
+#if defined(USE_GPIB_TASK) && (!defined(ESP32) || CONFIG_FREERTOS_UNICORE)
+  #undef USE_GPIB_TASK
+#endif
+
+
 /***** Enable SN7516x chips *****/
 /*
  * Uncomment to enable the use of SN7516x GPIB tranceiver ICs.
@@ -188,6 +221,17 @@
 #endif
 
 
+/***** TCP server (wifi) *****/
+/*
+ * Each TCP client gets its own session: parse buffer and Prologix
+ * settings (addr, auto, eos, eor, eoi). Uses about 270 bytes of RAM
+ * per client.
+ */
+#ifdef AR488_WIFI_ENABLE
+  #define AR_TCP_CLIENTS 4      // Number of simultaneous TCP clients
+#endif
+
+
 /***** Acknowledge interface is ready *****/
 //#define SAY_HELLO
 
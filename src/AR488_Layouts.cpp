@@ -12,6 +12,91 @@
 
 extern GPIB gpib;
 
+
+/***** Data bus direction tracking *****/
+/*
+ * The direction of the data bus pins is only changed on a real talk/listen
+ * transition: readyGpibDbus() and setGpibDbus() first check the direction
+ * cached here and skip the DDR/pinMode reconfiguration when it is already
+ * set. Each actual change is counted (see getDbusDirChanges()).
+ */
+static uint8_t dbusDir = DBUS_UNSET;
+static uint16_t dbusDirChanges = 0;
+
+/* Record a switch of the data bus to dir; returns false if already set */
+static bool dbusSwitchTo(uint8_t dir) {
+  if (dbusDir == dir) return false;
+  dbusDir = dir;
+  dbusDirChanges++;
+  return true;
+}
+
+uint16_t getDbusDirChanges() {
+  return dbusDirChanges;
+}
+
+void resetDbusDirChanges() {
+  dbusDirChanges = 0;
+}
+
+
+/***** Handshake timing *****/
+/*
+ * getHsTicks() is a free-running counter used for sub-millisecond handshake
+ * timeouts: the CPU cycle counter (CCOUNT) on ESP32, the DWT cycle counter
+ * on STM32 and micros() elsewhere. Compare (getHsTicks() - start) against
+ * hsUsToTicks(us); the difference stays valid across counter wrap-around.
+ */
+#if defined(ESP32)
+
+uint32_t getHsTicks() {
+  return ESP.getCycleCount();
+}
+
+uint32_t hsUsToTicks(uint32_t us) {
+  return us * getCpuFrequencyMhz();
+}
+
+#elif defined(ARDUINO_ARCH_STM32)
+
+uint32_t getHsTicks() {
+  return DWT->CYCCNT;
+}
+
+uint32_t hsUsToTicks(uint32_t us) {
+  // Start the cycle counter if not already running
+  if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+  return us * (SystemCoreClock / 1000000);
+}
+
+#else
+
+uint32_t getHsTicks() {
+  return micros();
+}
+
+uint32_t hsUsToTicks(uint32_t us) {
+  return us;
+}
+
+#endif
+
+
+/***** Read the level of a control line *****/
+#if !(defined(AR488_CUSTOM) && defined(ESP32))
+uint8_t getGpibPin(uint8_t pin) {
+#ifdef ARDUINO_ARCH_STM32
+  return digitalReadFast(digitalPinToPinName(pin));
+#else
+  return digitalRead(pin);
+#endif
+}
+#endif
+
 /*********************************/
 /***** UNO/NANO BOARD LAYOUT *****/
 /***** vvvvvvvvvvvvvvvvvvvvv *****/
@@ -19,6 +104,7 @@ extern GPIB gpib;
 
 /***** Read the status of the GPIB data bus wires and collect the byte of data *****/
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   // Set data pins to input
   DDRD &= 0b11001111 ;
   DDRC &= 0b11000000 ;
@@ -37,8 +123,10 @@ uint8_t readGpibDbus() {
 /***** Set the status of the GPIB data bus wires with a byte of datacd ~/test *****/
 void setGpibDbus(uint8_t db) {
   // Set data pins as outputs
-  DDRD |= 0b00110000;
-  DDRC |= 0b00111111;
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    DDRD |= 0b00110000;
+    DDRC |= 0b00111111;
+  }
 
   // GPIB states are inverted
   db = ~db;
@@ -106,6 +194,7 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
 /***** Read the status of the GPIB data bus wires and collect the byte of data *****/
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   // Set data pins to input
 //  DDRD &= 0b11001111 ;
 //  DDRC &= 0b11000000 ;
@@ -128,7 +217,7 @@ void setGpibDbus(uint8_t db) {
 //  DDRD |= 0b00110000;
 //  DDRC |= 0b00111111;
 
-  DDRF |= 0b11111111;
+  if (dbusSwitchTo(DBUS_OUTPUT)) DDRF |= 0b11111111;
 
   // GPIB states are inverted
 //  db = ~db;
@@ -202,6 +291,7 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
 /***** Read the status of the GPIB data bus wires and collect the byte of data *****/
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   // Set data pins to input
   DDRA &= 0b10101010 ;
   DDRC &= 0b01010101 ;
@@ -236,8 +326,10 @@ void setGpibDbus(uint8_t db) {
   uint8_t val = 0;
 
   // Set data pins as outputs
-  DDRA |= 0b01010101 ;
-  DDRC |= 0b10101010 ;
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    DDRA |= 0b01010101 ;
+    DDRC |= 0b10101010 ;
+  }
 
   // GPIB states are inverted
   db = ~db;
@@ -334,6 +426,7 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
 /***** Read the status of the GPIB data bus wires and collect the byte of data *****/
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
 
   // Set data pins to input
   DDRA &= 0b01010101 ;
@@ -369,8 +462,10 @@ void setGpibDbus(uint8_t db) {
   uint8_t val = 0;
 
   // Set data pins as outputs
-  DDRA |= 0b10101010 ;
-  DDRC |= 0b01010101 ;
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    DDRA |= 0b10101010 ;
+    DDRC |= 0b01010101 ;
+  }
 
   // GPIB states are inverted
   db = ~db;
@@ -460,6 +555,7 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 #ifdef AR488_MEGA32U4_MICRO
 
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   // Set data pins to input
   DDRB  &= 0b10000001 ;
   DDRD  &= 0b01111110 ;
@@ -495,8 +591,10 @@ void setGpibDbus(uint8_t db) {
   //Serial.println(db, HEX);
 
   // Set data pins as outputs
-  DDRB |= 0b01111110;
-  DDRD |= 0b10000001;
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    DDRB |= 0b01111110;
+    DDRD |= 0b10000001;
+  }
 
   // GPIB states are inverted
   db = ~db;
@@ -609,6 +707,7 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
 /***** Ready the GPIB data bus wires to receive data *****/
 void readyGpibDbus() {
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   // Set data pins to input
 
   DDRC &= 0b10111111 ;
@@ -632,9 +731,11 @@ void setGpibDbus(uint8_t db) {
 //  uint8_t rdb;
   uint8_t portf;
   // Set data pins as outputs
-  DDRC |= 0b01000000;
-  DDRD |= 0b00010000;
-  DDRF |= 0b11110011;
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    DDRC |= 0b01000000;
+    DDRD |= 0b00010000;
+    DDRF |= 0b11110011;
+  }
 
   // GPIB states are inverted
   db = ~db;
@@ -725,11 +826,105 @@ uint8_t databus[8] = { DIO1, DIO2, DIO3, DIO4, DIO5, DIO6, DIO7, DIO8 };
 uint8_t ctrlbus[8] = { IFC, NDAC, NRFD, DAV, EOI, REN, SRQ, ATN };
 
 
+#ifdef ESP32
+/***** ESP32 register level access to the data bus *****/
+/*
+ * The DIO pins are known at compile time, so the GPIO register masks are
+ * folded into constants. GPIO 0-31 are handled by GPIO.in, out_w1ts and
+ * out_w1tc (bank 0), GPIO 32 and above by GPIO.in1, out1_w1ts and out1_w1tc
+ * (bank 1). A bus read is then one or two register loads plus a gather of
+ * the 8 bits, a bus write is one set and one clear store per bank.
+ */
+#include "soc/gpio_struct.h"
+
+// Mask of a pin in its register bank (0 if the pin is in the other bank)
+#define DIO_MASK(pin, bank) ((((pin) >> 5) == (bank)) ? (1UL << ((pin) & 31)) : 0UL)
+// Move bit 'bit' of the data byte to the position of 'pin' in bank 'bank'
+#define DIO_SCATTER(pin, bank, db, bit) \
+  ((((pin) >> 5) == (bank)) ? ((uint32_t)(((db) >> (bit)) & 1) << ((pin) & 31)) : 0UL)
+// Collect the level of 'pin' from the bank registers into bit 'bit'
+#define DIO_GATHER(pin, in0, in1, bit) \
+  ((uint8_t)((((((pin) >> 5) ? (in1) : (in0)) >> ((pin) & 31)) & 1) << (bit)))
+
+static const uint32_t dbusMask0 =
+  DIO_MASK(DIO1, 0) | DIO_MASK(DIO2, 0) | DIO_MASK(DIO3, 0) | DIO_MASK(DIO4, 0) |
+  DIO_MASK(DIO5, 0) | DIO_MASK(DIO6, 0) | DIO_MASK(DIO7, 0) | DIO_MASK(DIO8, 0);
+static const uint32_t dbusMask1 =
+  DIO_MASK(DIO1, 1) | DIO_MASK(DIO2, 1) | DIO_MASK(DIO3, 1) | DIO_MASK(DIO4, 1) |
+  DIO_MASK(DIO5, 1) | DIO_MASK(DIO6, 1) | DIO_MASK(DIO7, 1) | DIO_MASK(DIO8, 1);
+
+/***** Route the data bus pins to the GPIO matrix *****/
+/*
+ * pinMode() selects the GPIO function in the IO MUX and connects the output
+ * signal; this is done on the first direction change, afterwards only the
+ * enable registers need to be touched to change the direction of the pins.
+ */
+static void configGpibDbus() {
+  for (uint8_t i=0; i<8; i++) {
+    pinMode(databus[i], OUTPUT);
+    pinMode(databus[i], INPUT_PULLUP);
+  }
+}
+
+
+/***** Read the status of the GPIB data bus wires and collect the byte of data *****/
+void readyGpibDbus() {
+  if (dbusDir == DBUS_UNSET) configGpibDbus();
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
+  // Set data pins to input (pull-ups remain enabled)
+  if (dbusMask0) GPIO.enable_w1tc = dbusMask0;
+  if (dbusMask1) GPIO.enable1_w1tc.val = dbusMask1;
+}
+
+uint8_t readGpibDbus() {
+  uint32_t in0 = dbusMask0 ? GPIO.in : 0;
+  uint32_t in1 = dbusMask1 ? GPIO.in1.val : 0;
+
+  // GPIB states are inverted
+  return ~(DIO_GATHER(DIO1, in0, in1, 0) | DIO_GATHER(DIO2, in0, in1, 1) |
+           DIO_GATHER(DIO3, in0, in1, 2) | DIO_GATHER(DIO4, in0, in1, 3) |
+           DIO_GATHER(DIO5, in0, in1, 4) | DIO_GATHER(DIO6, in0, in1, 5) |
+           DIO_GATHER(DIO7, in0, in1, 6) | DIO_GATHER(DIO8, in0, in1, 7));
+}
+
+/***** Set the status of the GPIB data bus wires with a byte of data *****/
+void setGpibDbus(uint8_t db) {
+  bool setdir;
+
+  if (dbusDir == DBUS_UNSET) configGpibDbus();
+  setdir = dbusSwitchTo(DBUS_OUTPUT);
+
+  // Asserted (1) bits drive the line LOW, the others are released HIGH
+  if (dbusMask0) {
+    uint32_t low = DIO_SCATTER(DIO1, 0, db, 0) | DIO_SCATTER(DIO2, 0, db, 1) |
+                   DIO_SCATTER(DIO3, 0, db, 2) | DIO_SCATTER(DIO4, 0, db, 3) |
+                   DIO_SCATTER(DIO5, 0, db, 4) | DIO_SCATTER(DIO6, 0, db, 5) |
+                   DIO_SCATTER(DIO7, 0, db, 6) | DIO_SCATTER(DIO8, 0, db, 7);
+    GPIO.out_w1tc = low;
+    GPIO.out_w1ts = dbusMask0 & ~low;
+    // Set data pins as outputs
+    if (setdir) GPIO.enable_w1ts = dbusMask0;
+  }
+  if (dbusMask1) {
+    uint32_t low = DIO_SCATTER(DIO1, 1, db, 0) | DIO_SCATTER(DIO2, 1, db, 1) |
+                   DIO_SCATTER(DIO3, 1, db, 2) | DIO_SCATTER(DIO4, 1, db, 3) |
+                   DIO_SCATTER(DIO5, 1, db, 4) | DIO_SCATTER(DIO6, 1, db, 5) |
+                   DIO_SCATTER(DIO7, 1, db, 6) | DIO_SCATTER(DIO8, 1, db, 7);
+    GPIO.out1_w1tc.val = low;
+    GPIO.out1_w1ts.val = dbusMask1 & ~low;
+    // Set data pins as outputs
+    if (setdir) GPIO.enable1_w1ts.val = dbusMask1;
+  }
+}
+
+#else  // !ESP32
+
 /***** Read the status of the GPIB data bus wires and collect the byte of data *****/
 void readyGpibDbus() {
   //for (uint8_t i=0; i<8; i++){
   //  pinMode(databus[i], INPUT_PULLUP);
   //}
+  if (!dbusSwitchTo(DBUS_INPUT)) return;
   pinMode(databus[0], INPUT_PULLUP);
   pinMode(databus[1], INPUT_PULLUP);
   pinMode(databus[2], INPUT_PULLUP);
@@ -767,14 +962,16 @@ void setGpibDbus(uint8_t db) {
     digitalWrite(databus[i], ((db&(1<<i)) ? LOW : HIGH) );
   }
   */
-  pinMode(databus[0], OUTPUT);
-  pinMode(databus[1], OUTPUT);
-  pinMode(databus[2], OUTPUT);
-  pinMode(databus[3], OUTPUT);
-  pinMode(databus[4], OUTPUT);
-  pinMode(databus[5], OUTPUT);
-  pinMode(databus[6], OUTPUT);
-  pinMode(databus[7], OUTPUT);
+  if (dbusSwitchTo(DBUS_OUTPUT)) {
+    pinMode(databus[0], OUTPUT);
+    pinMode(databus[1], OUTPUT);
+    pinMode(databus[2], OUTPUT);
+    pinMode(databus[3], OUTPUT);
+    pinMode(databus[4], OUTPUT);
+    pinMode(databus[5], OUTPUT);
+    pinMode(databus[6], OUTPUT);
+    pinMode(databus[7], OUTPUT);
+  }
   digitalWrite(databus[0], ((db&(1<<0)) ? LOW : HIGH));
   digitalWrite(databus[1], ((db&(1<<1)) ? LOW : HIGH));
   digitalWrite(databus[2], ((db&(1<<2)) ? LOW : HIGH));
@@ -785,6 +982,8 @@ void setGpibDbus(uint8_t db) {
   digitalWrite(databus[7], ((db&(1<<7)) ? LOW : HIGH));
 }
 
+#endif  // ESP32
+
 /***** Set the direction and state of the GPIB control lines ****/
 /*
    Bits control lines as follows: 7-ATN, 6-SRQ, 5-REN, 4-EOI, 3-DAV, 2-NRFD, 1-NDAC, 0-IFC
@@ -792,6 +991,74 @@ void setGpibDbus(uint8_t db) {
    dir  : 0=input; 1=output;
    mode:  0=set pin state; 1=set pin direction
 */
+#ifdef ESP32
+
+// GPIO register bit of each control line, in ctrlbus[] order
+static const uint32_t ctrlMask0[8] = {
+  DIO_MASK(IFC, 0), DIO_MASK(NDAC, 0), DIO_MASK(NRFD, 0), DIO_MASK(DAV, 0),
+  DIO_MASK(EOI, 0), DIO_MASK(REN, 0), DIO_MASK(SRQ, 0), DIO_MASK(ATN, 0)
+};
+static const uint32_t ctrlMask1[8] = {
+  DIO_MASK(IFC, 1), DIO_MASK(NDAC, 1), DIO_MASK(NRFD, 1), DIO_MASK(DAV, 1),
+  DIO_MASK(EOI, 1), DIO_MASK(REN, 1), DIO_MASK(SRQ, 1), DIO_MASK(ATN, 1)
+};
+static bool ctrlConfigured = false;
+
+/*
+ * As for the data bus, the control pins are routed with pinMode() once
+ * (leaving the pull-ups enabled) and then driven through the set/clear
+ * registers: a state change is at most one store per register and bank.
+ */
+void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
+  uint32_t hi0 = 0, lo0 = 0, hi1 = 0, lo1 = 0;
+
+  if (!ctrlConfigured) {
+    for (uint8_t i=0; i<8; i++) {
+      pinMode(ctrlbus[i], OUTPUT);
+      pinMode(ctrlbus[i], INPUT_PULLUP);
+    }
+    ctrlConfigured = true;
+  }
+
+  for (uint8_t i=0; i<8; i++) {
+    if (mask & (1<<i)) {
+      if (bits & (1<<i)) {
+        hi0 |= ctrlMask0[i];
+        hi1 |= ctrlMask1[i];
+      } else {
+        lo0 |= ctrlMask0[i];
+        lo1 |= ctrlMask1[i];
+      }
+    }
+  }
+
+  switch (mode) {
+    case 0:
+      // Set pin state
+      if (lo0) GPIO.out_w1tc = lo0;
+      if (hi0) GPIO.out_w1ts = hi0;
+      if (lo1) GPIO.out1_w1tc.val = lo1;
+      if (hi1) GPIO.out1_w1ts.val = hi1;
+      break;
+    case 1:
+      // Set pin direction (outputs: 1, inputs with pull-up: 0)
+      if (lo0) GPIO.enable_w1tc = lo0;
+      if (hi0) GPIO.enable_w1ts = hi0;
+      if (lo1) GPIO.enable1_w1tc.val = lo1;
+      if (hi1) GPIO.enable1_w1ts.val = hi1;
+      break;
+  }
+
+}
+
+/***** Read the level of a control line from the GPIO input registers *****/
+uint8_t getGpibPin(uint8_t pin) {
+  if (pin < 32) return (GPIO.in >> pin) & 1;
+  return (GPIO.in1.val >> (pin - 32)) & 1;
+}
+
+#else  // !ESP32
+
 void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
   switch (mode) {
@@ -811,6 +1078,8 @@ void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode) {
 
 }
 
+#endif  // ESP32
+
 #endif
 /***** ^^^^^^^^^^^^^^^^^^^^^^^^^ *****/
 /***** CUSTOM PIN LAYOUT SECTION *****/
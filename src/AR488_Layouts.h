@@ -251,6 +251,19 @@ uint8_t readGpibDbus();
 void setGpibDbus(uint8_t db);
 void setGpibState(uint8_t bits, uint8_t mask, uint8_t mode);
 
+/***** Data bus direction (cached by readyGpibDbus/setGpibDbus) *****/
+#define DBUS_UNSET  0
+#define DBUS_INPUT  1
+#define DBUS_OUTPUT 2
+
+uint16_t getDbusDirChanges();
+void resetDbusDirChanges();
+
+/***** Handshake line access and timing *****/
+uint8_t getGpibPin(uint8_t pin);
+uint32_t getHsTicks();
+uint32_t hsUsToTicks(uint32_t us);
+
 /***** ^^^^^^^^^^^^^^^^^^^^^^^^^^ *****/
 /***** GLOBAL DEFINITIONS SECTION *****/
 /**************************************/
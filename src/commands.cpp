@@ -42,22 +42,34 @@ static cmdRec cmdHidx [] = {
   { "trg",         2, &Controller::trg_h       },
   { "ver",         3, &Controller::ver_h       },
   // non-prologix commands
+  { "addr_tmo_us", 2, &Controller::atmo_h      },
+  { "addrcache",   2, &Controller::addrcache_h },
   { "allspoll",    2, &Controller::allspoll_h  },
+  { "byte_tmo_ms", 2, &Controller::btmo_h      },
   { "findrqs",     2, &Controller::findrqs_h   },
   { "findlstn",    2, &Controller::findlstn_h  },
+  { "flush_tmo_ms", 3, &Controller::oflush_h   },
   { "dcl",         2, &Controller::dcl_h       },
   { "default",     3, &Controller::default_h   },
   { "id",          3, &Controller::id_h        },
   { "idn",         3, &Controller::idn_h       },
+  { "lstn_tmo_us", 2, &Controller::ltmo_h      },
 #ifdef USE_MACROS
   { "macro",       3, &Controller::macro_h     },
 #endif
+  { "ppconf",      2, &Controller::ppconf_h    },
   { "ppoll",       2, &Controller::ppoll_h     },
+  { "ppu",         2, &Controller::ppu_h       },
+#ifdef USE_PROFILES
+  { "profile",     2, &Controller::profile_h   },
+#endif
   { "prompt",      3, &Controller::prompt_h    },
+  { "query",       2, &Controller::query_h     },
   { "ren",         2, &Controller::ren_h       },
   { "repeat",      2, &Controller::repeat_h    },
   { "setvstr",     3, &Controller::setvstr_h   },
   { "srqauto",     2, &Controller::srqa_h      },
+  { "srqevt",      2, &Controller::srqevt_h    },
   { "tct",         2, &Controller::tct_h       },
   { "ton",         1, &Controller::ton_h       },
   { "tmbus",       3, &Controller::tmbus_h     },
@@ -162,6 +174,9 @@ void Controller::addr_h(char *params) {
       cmdstream->print(F("Set device primary address to: "));
       cmdstream->println(val);
     }
+#ifdef USE_PROFILES
+    if (config.cmode == 2) applyProfile(val);
+#endif
 
     // Secondary address
     config.saddr = 0;
@@ -204,6 +219,74 @@ void Controller::rtmo_h(char *params) {
 }
 
 
+/***** Show or set the addressing timeout *****/
+void Controller::atmo_h(char *params) {
+  uint16_t val;
+  if (params != NULL) {
+    if (notInRange(params, 1, 60000, val)) return;
+    config.atmo = val;
+    if (config.isVerb) {
+      cmdstream->print(F("Set [addr_tmo_us] to: "));
+      cmdstream->print(val);
+      cmdstream->println(F(" microseconds"));
+    }
+  } else {
+    cmdstream->println(config.atmo);
+  }
+}
+
+
+/***** Show or set the inter-byte timeout *****/
+void Controller::btmo_h(char *params) {
+  uint16_t val;
+  if (params != NULL) {
+    if (notInRange(params, 1, 32000, val)) return;
+    config.btmo = val;
+    if (config.isVerb) {
+      cmdstream->print(F("Set [byte_tmo_ms] to: "));
+      cmdstream->print(val);
+      cmdstream->println(F(" milliseconds"));
+    }
+  } else {
+    cmdstream->println(config.btmo);
+  }
+}
+
+
+/***** Show or set the listener detection timeout *****/
+void Controller::ltmo_h(char *params) {
+  uint16_t val;
+  if (params != NULL) {
+    if (notInRange(params, 1, 60000, val)) return;
+    config.ltmo = val;
+    if (config.isVerb) {
+      cmdstream->print(F("Set [lstn_tmo_us] to: "));
+      cmdstream->print(val);
+      cmdstream->println(F(" microseconds"));
+    }
+  } else {
+    cmdstream->println(config.ltmo);
+  }
+}
+
+
+/***** Show or set the output flush deadline *****/
+void Controller::oflush_h(char *params) {
+  uint16_t val;
+  if (params != NULL) {
+    if (notInRange(params, 0, 1000, val)) return;
+    config.oflush = val;
+    if (config.isVerb) {
+      cmdstream->print(F("Set [flush_tmo_ms] to: "));
+      cmdstream->print(val);
+      cmdstream->println(F(" milliseconds"));
+    }
+  } else {
+    cmdstream->println(config.oflush);
+  }
+}
+
+
 /***** Show or set end of send character *****/
 void Controller::eos_h(char *params) {
   uint16_t val;
@@ -235,6 +318,32 @@ void Controller::eoi_h(char *params) {
   }
 }
 
+/***** Show or enable/disable the addressing cache *****/
+/*
+ * When enabled, the talker and listeners addressed on the bus are tracked
+ * and UNL/TAD/LAD are only sent when they change; devices are left
+ * addressed after a transfer.
+ */
+void Controller::addrcache_h(char *params) {
+  uint16_t val;
+  if (params != NULL) {
+    if (notInRange(params, 0, 1, val)) return;
+    config.addrcache = val ? true : false;
+    gpib->clearAddrCache();
+    gpib->addrSaved = 0;
+    if (config.isVerb) {
+      cmdstream->print(F("Set addressing cache: "));
+      cmdstream->println(val ? "ON" : "OFF");
+    };
+  } else {
+    cmdstream->println(config.addrcache);
+    if (config.isVerb) {
+      cmdstream->print(F("Command bytes saved: "));
+      cmdstream->println(gpib->addrSaved);
+    }
+  }
+}
+
 /***** Show or set EOI assertion on/off *****/
 void Controller::tct_h(char *params) {
   uint16_t val;
@@ -374,9 +483,21 @@ void Controller::read_h(char *params) {
   // Clear read flags
   gpib->rEoi = false;
   gpib->rEbt = false;
+  gpib->rBlk = false;
+  gpib->rCnt = 0;
   // Read any parameters
   if (params != NULL) {
-    if (strlen(params) > 3) {
+    if (strncmp(params, "block", 5) == 0) { // Read up to the end of a #<n><len> block
+      gpib->rBlk = true;
+    } else if (strncmp(params, "count", 5) == 0) { // Read a fixed number of bytes
+      char *param = strtok(params + 5, " \t");
+      if (param != NULL) gpib->rCnt = strtoul(param, NULL, 10);
+      if (gpib->rCnt == 0) {
+        errBadCmd();
+        if (config.isVerb) cmdstream->println(F("Byte count required"));
+        return;
+      }
+    } else if (strlen(params) > 3) {
       if (config.isVerb) cmdstream->println(F("Invalid termination character - ignored!"));
     } else if (strncmp(params, "eoi", 3) == 0) { // Read with eoi detection
       gpib->rEoi = true;
@@ -389,15 +510,35 @@ void Controller::read_h(char *params) {
     // In auto continuous mode we set this flag to indicate we are ready for continuous read
     aRead = true;
   } else {
-    // If auto mode is disabled we do a single read
-    gpib->gpibReceiveData();
+    // If auto mode is disabled we do a single read, advanced from loop()
+    gpib->xfrReceive();
   }
 }
 
 
+/***** Send a query to the device and read the response *****/
+/*
+ * Single bus transaction: the device is readdressed to talk as soon as the
+ * query has been written.
+ */
+void Controller::query_h(char *params) {
+  if (params == NULL) {
+    errBadCmd();
+    if (config.isVerb) cmdstream->println(F("Query text required"));
+    return;
+  }
+  // Read with the configured terminator
+  gpib->rEoi = false;
+  gpib->rEbt = false;
+  gpib->rBlk = false;
+  gpib->rCnt = 0;
+  gpib->gpibQuery(params, strlen(params));
+}
+
+
 /***** Send device clear (usually resets the device to power on state) *****/
 void Controller::clr_h(char *params) {
-  if (gpib->addrDev(config.paddr, 0)) {
+  if (gpib->addrDev(config.paddr, config.saddr, 0)) {
     if (config.isVerb) cmdstream->println(F("Failed to address device"));
     return;
   }
@@ -427,7 +568,7 @@ void Controller::llo_h(char *params) {
       }
     } else {
       // Address current device
-      if (gpib->addrDev(config.paddr, 0)) {
+      if (gpib->addrDev(config.paddr, config.saddr, 0)) {
         if (config.isVerb) cmdstream->println(F("Failed to address the device."));
         return;
       }
@@ -465,7 +606,7 @@ void Controller::loc_h(char *params) {
       }
     } else {
       // Address device to listen
-      if (gpib->addrDev(config.paddr, 0)) {
+      if (gpib->addrDev(config.paddr, config.saddr, 0)) {
         if (config.isVerb) cmdstream->println(F("Failed to address device."));
         return;
       }
@@ -526,25 +667,21 @@ void Controller::trg_h(char *params) {
 
   // If we have some addresses to trigger....
   if (cnt > 0) {
+    // Address all the devices to listen, then send a single GET so that
+    // they are all triggered together, and unlisten in one command burst
+    uint8_t cmds[19];
+    uint8_t n = 0;
+    cmds[n++] = GC_UNL;
     for (int i = 0; i < cnt; i++) {
-      // Address the device
-      if (gpib->addrDev(addrs[i], 0)) {
-        if (config.isVerb)
-      cmdstream->println(String("Failed to address device ") + addrs[i]);
-        continue;
-      }
-      // Send GTL
-      if (gpib->gpibSendCmd(GC_GET))  {
-        if (config.isVerb)
-      cmdstream->println(String("Failed to send command to device ") + addrs[i]);
-        continue;
-      }
-      // Unaddress device
-      if (gpib->uaddrDev()) {
-        if (config.isVerb)
-      cmdstream->println(String("Failed to unaddress device ") + addrs[i]);
-        continue;
-      }
+      cmds[n++] = GC_LAD + addrs[i];
+    }
+    // Addressed device only: include its secondary address
+    if (params == NULL && config.saddr) cmds[n++] = config.saddr;
+    cmds[n++] = GC_GET;
+    cmds[n++] = GC_UNL;
+    if (gpib->gpibSendCmds(cmds, n))  {
+      if (config.isVerb) cmdstream->println(F("Failed to trigger devices"));
+      return;
     }
 
     // Set GPIB controls back to idle state
@@ -712,147 +849,86 @@ void Controller::spoll(char *params, int mode) {
   // mode: 0=spoll one, 1=allspoll, 2=findsrq
   char *param;
   uint8_t addrs[31];
-  uint8_t sb = 0;
-  uint8_t r;
-  //  uint8_t i = 0;
   uint8_t n_addr = 0;
   uint16_t val = 0;
-  bool eoiDetected = false;
-
-  // Initialise address array
-  for (int i = 0; i < 31; i++) {
-    addrs[i] = 0;
-  }
+  uint8_t sa = 0;
 
   // Read parameters
   if (params == NULL) {
-    // No parameters - trigger addressed device only
+    // No parameters - poll addressed device only (with its secondary address)
     addrs[0] = config.paddr;
+    sa = config.saddr;
     n_addr = 1;
+  } else if (strncmp(params, "all", 3) == 0) {
+    // All primary addresses but our own
+    for (uint8_t a = 0; a < 31; a++) {
+      if (a != config.caddr) addrs[n_addr++] = a;
+    }
   } else {
     // Read address parameters into array
     for (param=strtok(params, " \t"), n_addr=0;
         (param != NULL) && (n_addr < 31);
         param = strtok(NULL, " \t"), ++n_addr) {
-      if ((strlen(params) < 2) && !(notInRange(param, 0, 30, val))) {
-        addrs[n_addr] = (uint8_t)val;
-      } else {
-        errBadCmd();
-        if (config.isVerb) cmdstream->println(F("Invalid parameter"));
-        return;
-      }
+      if (notInRange(param, 0, 30, val)) return;
+      addrs[n_addr] = (uint8_t)val;
     }
   }
-  if (mode == 0 && n_addr > 1) {
-    // only addr is supported in default spoll mode; secondary addresses are not yet supported
-    errBadCmd();
-    if (config.isVerb) cmdstream->println(F("Invalid parameter"));
-    return;
-  }
+  // Polling several devices with ++spoll looks for the one requesting service
+  if (mode == 0 && n_addr > 1) mode = 2;
+
+  spollAddrs(addrs, n_addr, sa, mode);
+}
 
-  if (config.isVerb)
-    cmdstream->println(String("Got ") + n_addr + " devices to spoll");
 
-  // Send Unlisten [UNL] to all devices
-  if ( gpib->gpibSendCmd(GC_UNL) )  {
-#ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send UNL"));
-#endif
-    return;
-  }
+/***** Serial poll the devices at addrs and report the status bytes *****/
+void Controller::spollAddrs(uint8_t *addrs, uint8_t n_addr, uint8_t sa, int mode) {
+  // mode: 0=spoll one, 1=allspoll, 2=findsrq
+  int16_t stb[31];
+  uint8_t n_polled;
 
-  // Controller addresses itself as listner
-  if ( gpib->gpibSendCmd(GC_LAD + config.caddr) )  {
-#ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send LAD"));
-#endif
-    return;
+  if (config.isVerb) {
+    cmdstream->print(F("Got "));
+    cmdstream->print(n_addr);
+    cmdstream->println(F(" devices to spoll"));
   }
 
-  // Send Serial Poll Enable [SPE] to all devices
-  if ( gpib->gpibSendCmd(GC_SPE) )  {
+  // Collect the status bytes, stopping at the first RQS in FINDRQS mode
+  n_polled = n_addr;
+  if (gpib->serialPoll(addrs, n_polled, sa, stb, (mode == 2))) {
 #ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send SPE"));
+    dbSerial->println(F("spoll: serial poll failed"));
 #endif
+    if (config.isVerb) cmdstream->println(F("Serial poll failed"));
     return;
   }
 
-  // Poll GPIB address or addresses as set by i and j
-  for (int i=0; i < n_addr; i++) {
-
-    // Set GPIB address in val
-    val = addrs[i];
-
-    // Don't need to poll own address
-    if (val != config.caddr) {
-      if (config.isVerb) {
-        cmdstream->println(String("Polling ") + val);
-      }
-      // Address a device to talk
-      if ( gpib->gpibSendCmd(GC_TAD + val) )  {
-
-#ifdef DEBUG4
-        dbSerial->println(F("spoll: failed to send TAD"));
-#endif
-        return;
-      }
-
-      // Set GPIB control to controller active listner state (ATN unasserted)
-      gpib->setGpibControls(CLAS);
-
-      // Read the response byte (usually device status) using handshake
-      r = gpib->gpibReadByte(&sb, &eoiDetected);
-
-      // If we successfully read a byte
-      if (!r) {
-        if (mode == 2) {
-          // If in FINDRQS mode, return specially formatted response: SRQ:addr,status
-          // but only when RQS bit set
-          if (sb & 0x40) {
-            cmdstream->print(String(F("SRQ:")) + val + F(","));
-            cmdstream->print(sb, DEC);
-            break;
-          }
-        } else if (mode == 1) {
-          // ALLSPOLL mode, return a specially formatted response: 'addr:status '
-          cmdstream->print(String(val) + F(":") + sb + " ");
-        } else {
-          // SPOLL mode
-          // Return decimal number representing status byte
-          cmdstream->print(sb, DEC);
-        }
+  // Report the results in one line
+  for (uint8_t i = 0; i < n_polled; i++) {
+    // No response from the device
+    if (stb[i] < 0) continue;
+    if (mode == 2) {
+      // If in FINDRQS mode, return specially formatted response: SRQ:addr,status
+      // but only when RQS bit set
+      if (stb[i] & 0x40) {
+        cmdstream->print(F("SRQ:"));
+        cmdstream->print(addrs[i]);
+        cmdstream->print(F(","));
+        cmdstream->print(stb[i], DEC);
       }
+    } else if (mode == 1) {
+      // ALLSPOLL mode, return a specially formatted response: 'addr:status '
+      cmdstream->print(addrs[i]);
+      cmdstream->print(F(":"));
+      cmdstream->print(stb[i], DEC);
+      cmdstream->print(F(" "));
+    } else {
+      // SPOLL mode
+      // Return decimal number representing status byte
+      cmdstream->print(stb[i], DEC);
     }
   }
   cmdstream->println();
 
-  // Send Serial Poll Disable [SPD] to all devices
-  if ( gpib->gpibSendCmd(GC_SPD) )  {
-#ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send SPD"));
-#endif
-    return;
-  }
-
-  // Send Untalk [UNT] to all devices
-  if ( gpib->gpibSendCmd(GC_UNT) )  {
-#ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send UNT"));
-#endif
-    return;
-  }
-
-  // Unadress listners [UNL] to all devices
-  if ( gpib->gpibSendCmd(GC_UNL) )  {
-#ifdef DEBUG4
-    dbSerial->println(F("spoll: failed to send UNL"));
-#endif
-    return;
-  }
-
-  // Set GPIB control to controller idle state
-  gpib->setGpibControls(CIDS);
-
   // Set SRQ to status of SRQ line. Should now be unasserted but, if it is
   // still asserted, then another device may be requesting service so another
   // serial poll will be called from the main loop
@@ -867,14 +943,19 @@ void Controller::spoll(char *params, int mode) {
  * Does only look for primary addresses for now
  */
 void Controller::findlstn_h(char *params) {
-  uint8_t addrs[31];
-  if ( gpib->findListeners(addrs) )  {
+  uint16_t addrs[31];
+  if ( gpib->findListeners(addrs, 31) )  {
     if (config.isVerb) cmdstream->println(F("FINDLSTN failed"));
     return;
   }
   for(int i=0; i<31; i++) {
-    if (addrs[i] < 31) {
-      cmdstream->print(addrs[i]);
+    if (addrs[i] != 0xFFFF) {
+      // Primary address, followed by ,<secondary> for extended addressing
+      cmdstream->print(addrs[i] & 0xFF);
+      if (addrs[i] >> 8) {
+        cmdstream->print(",");
+        cmdstream->print(addrs[i] >> 8);
+      }
       cmdstream->print(" ");
     }
   }
@@ -906,15 +987,50 @@ void Controller::default_h(char *params) {
 void Controller::eor_h(char *params) {
   uint16_t val;
   if (params != NULL) {
-    if (notInRange(params, 0, 15, val)) return;
+    if (strncmp(params, "custom", 6) == 0) {
+      // Custom sequence given as hex bytes, e.g. 0d0a03
+      char *param = strtok(params + 6, " \t");
+      uint8_t seq[TERM_MAXLEN];
+      uint8_t len = 0;
+      if ((param == NULL) || (strlen(param) % 2) || (strlen(param) > 2 * TERM_MAXLEN)) {
+        errBadCmd();
+        if (config.isVerb) cmdstream->println(F("Expected 1 to 8 bytes in hex, e.g. 0d0a03"));
+        return;
+      }
+      for (; *param; param += 2) {
+        char hex[3] = { param[0], param[1], '\0' };
+        char *end;
+        seq[len++] = strtoul(hex, &end, 16);
+        if (*end != '\0') {
+          errBadCmd();
+          if (config.isVerb) cmdstream->println(F("Invalid hex byte"));
+          return;
+        }
+      }
+      memcpy(config.eorseq, seq, len);
+      config.eorlen = len;
+      val = 8;
+    } else {
+      if (notInRange(params, 0, 15, val)) return;
+    }
     config.eor = (uint8_t)val;
+    gpib->setTerminator();
     if (config.isVerb) {
       cmdstream->print(F("Set EOR to: "));
       cmdstream->println(val);
     };
   } else {
-    if (config.eor>7) config.eor = 0;  // Needed to reset FF read from EEPROM after FW upgrade
-    cmdstream->println(config.eor);
+    if (config.eor>8) config.eor = 0;  // Needed to reset FF read from EEPROM after FW upgrade
+    cmdstream->print(config.eor);
+    if (config.eor == 8) {
+      // Show the custom sequence
+      cmdstream->print(' ');
+      for (uint8_t i = 0; i < config.eorlen; i++) {
+        if (config.eorseq[i] < 0x10) cmdstream->print('0');
+        cmdstream->print(config.eorseq[i], HEX);
+      }
+    }
+    cmdstream->println();
   }
 }
 
@@ -927,17 +1043,7 @@ void Controller::ppoll_h(char *params) {
   uint8_t sb = 0;
 
   // Poll devices
-  // Start in controller idle state
-  gpib->setGpibControls(CIDS);
-  delayMicroseconds(20);
-  // Assert ATN and EOI
-  setGpibState(0b00000000, 0b10010000, 0);
-  //  setGpibState(0b10010000, 0b00000000, 0b10010000);
-  delayMicroseconds(20);
-  // Read data byte from GPIB bus without handshake
-  sb = readGpibDbus();
-  // Return to controller idle state (ATN and EOI unasserted)
-  gpib->setGpibControls(CIDS);
+  sb = gpib->parallelPoll();
 
   // Output the response byte
   cmdstream->println(sb, DEC);
@@ -946,6 +1052,167 @@ void Controller::ppoll_h(char *params) {
 }
 
 
+/***** Configure the parallel poll response of a device *****/
+/*
+ * ++ppconf <addr> <line> <sense> sends PPC and PPE so that the device
+ * drives DIO<line> during a parallel poll when its status bit (ist)
+ * matches <sense>; ++ppconf <addr> off sends PPC and PPD. The line of
+ * each device is recorded for the SRQ auto mode 2.
+ */
+void Controller::ppconf_h(char *params) {
+  char *param;
+  uint16_t addr;
+  uint16_t line = 0;
+  uint16_t sense = 0;
+
+  param = (params != NULL) ? strtok(params, " \t") : NULL;
+  if (notInRange(param, 0, 30, addr)) return;
+  if (addr == config.caddr) {
+    errBadCmd();
+    return;
+  }
+  param = strtok(NULL, " \t");
+  if ((param == NULL) || (strncmp(param, "off", 3) != 0)) {
+    if (notInRange(param, 1, 8, line)) return;
+    param = strtok(NULL, " \t");
+    if (notInRange(param, 0, 1, sense)) return;
+  }
+  ppConfig(addr, line, sense);
+}
+
+
+/***** Send PPC followed by PPE (line 1-8) or PPD (line 0) to a device *****/
+void Controller::ppConfig(uint8_t addr, uint8_t line, uint8_t sense) {
+  // PPE: sense in bit 3, line (DIO1-8 as 0-7) in bits 0-2
+  uint8_t ppe = line ? (GC_PPE | (sense << 3) | (line - 1)) : GC_PPD;
+
+  uint8_t cmds[5] = { GC_UNL, (uint8_t)(GC_LAD + addr), GC_PPC, ppe, GC_UNL };
+  if (gpib->gpibSendCmds(cmds, 5)) {
+    if (config.isVerb) cmdstream->println(F("Failed to configure parallel poll"));
+    return;
+  }
+  gpib->setGpibControls(CIDS);
+
+  // Record the line the device now responds on
+  for (uint8_t i = 0; i < 8; i++) {
+    ppLines[i] &= ~(1UL << addr);
+  }
+  if (line) ppLines[line - 1] |= 1UL << addr;
+
+  if (config.isVerb) {
+    cmdstream->print(F("Parallel poll of device "));
+    cmdstream->print(addr);
+    if (line) {
+      cmdstream->print(F(" on DIO"));
+      cmdstream->println(line);
+    } else {
+      cmdstream->println(F(" disabled"));
+    }
+  }
+}
+
+
+/***** Unconfigure parallel poll *****/
+/*
+ * Without parameter sends PPU to all devices, otherwise PPC and PPD to
+ * the device at the given address.
+ */
+void Controller::ppu_h(char *params) {
+  uint16_t addr;
+
+  if (params == NULL) {
+    if (gpib->gpibSendCmd(GC_PPU)) {
+      if (config.isVerb) cmdstream->println(F("Failed to send PPU"));
+      return;
+    }
+    gpib->setGpibControls(CIDS);
+    for (uint8_t i = 0; i < 8; i++) {
+      ppLines[i] = 0;
+    }
+    if (config.isVerb) cmdstream->println(F("Parallel poll unconfigured"));
+  } else {
+    if (notInRange(params, 0, 30, addr)) return;
+    if (addr == config.caddr) {
+      errBadCmd();
+      return;
+    }
+    ppConfig(addr, 0, 0);
+  }
+}
+
+
+#ifdef USE_PROFILES
+/***** Show, set or clear the profile of the addressed device *****/
+/*
+ * ++profile         show the profile of the device (eos eor eoi read_tmo_ms tmbus)
+ * ++profile set     store the current settings as the profile of the device
+ * ++profile clear   remove the profile of the device
+ * ++profile clear all
+ */
+void Controller::profile_h(char *params) {
+  AR488Profile *prof = &profiles[config.paddr];
+  char *param = strtok(params, " \t");
+
+  if (param == NULL) {
+    if (!prof->valid) {
+      cmdstream->println(F("none"));
+      return;
+    }
+    cmdstream->print(prof->eos);
+    cmdstream->print(F(" "));
+    cmdstream->print(prof->eor);
+    cmdstream->print(F(" "));
+    cmdstream->print(prof->eoi);
+    cmdstream->print(F(" "));
+    cmdstream->print(prof->rtmo);
+    cmdstream->print(F(" "));
+    cmdstream->println(prof->tmbus);
+  } else if (strncmp(param, "set", 3) == 0) {
+    prof->valid = true;
+    prof->eoi = config.eoi;
+    prof->eos = config.eos;
+    prof->eor = config.eor;
+    prof->rtmo = config.rtmo;
+    prof->tmbus = config.tmbus;
+    if (config.isVerb) {
+      cmdstream->print(F("Profile set for device "));
+      cmdstream->println(config.paddr);
+    }
+  } else if (strncmp(param, "clear", 5) == 0) {
+    param = strtok(NULL, " \t");
+    if ((param != NULL) && (strncmp(param, "all", 3) == 0)) {
+      clearProfiles();
+    } else {
+      prof->valid = false;
+    }
+    if (config.isVerb) cmdstream->println(F("Profile cleared"));
+  } else {
+    errBadCmd();
+  }
+}
+
+
+/***** Apply the profile of the device at addr, if any *****/
+void Controller::applyProfile(uint8_t addr) {
+  AR488Profile *prof = &profiles[addr];
+
+  if (!prof->valid) return;
+  config.eoi = prof->eoi;
+  config.eos = prof->eos;
+  config.eor = prof->eor;
+  config.rtmo = prof->rtmo;
+  config.tmbus = prof->tmbus;
+  gpib->setTerminator();
+  if (config.isVerb) cmdstream->println(F("Applied device profile"));
+}
+
+
+void Controller::clearProfiles() {
+  memset(profiles, 0, sizeof(profiles));
+}
+#endif
+
+
 /***** Assert or de-assert REN 0=de-assert; 1=assert *****/
 void Controller::ren_h(char *params) {
 #if defined (SN7516X) && not defined (SN7516X_DC)
@@ -1049,25 +1316,114 @@ void Controller::ton_h(char *params) {
  * In device mode, when the SRQ interrupt is triggered and SRQ
  * auto is set to 1, a serial poll is conducted automatically
  * and the status byte for the instrument requiring service is
- * automatically returned. When srqauto is set to 0 (default)
- * an ++spoll command needs to be given manually to return
- * the status byte.
+ * automatically returned. With SRQ auto set to 2, a parallel
+ * poll first selects the devices to serial poll (see srqService).
+ * When srqauto is set to 0 (default) an ++spoll command needs
+ * to be given manually to return the status byte.
  */
 void Controller::srqa_h(char *params) {
   uint16_t val;
   if (params != NULL) {
-    if (notInRange(params, 0, 1, val)) return;
-    switch (val) {
-      case 0:
-        isSrqa = false;
-        break;
-      case 1:
-        isSrqa = true;
-        break;
+    if (notInRange(params, 0, 2, val)) return;
+    srqaMode = val;
+    if (config.isVerb) cmdstream->println(srqaMode ? "SRQ auto ON" : "SRQ auto OFF") ;
+  } else {
+    cmdstream->println(srqaMode);
+  }
+}
+
+
+/***** Service a request (SRQ asserted) in SRQ auto mode *****/
+/*
+ * Mode 1 serial polls the addressed device. In mode 2, a parallel poll
+ * returns the lines of the devices requesting service (configured with
+ * ++ppconf, sense 1) and only the devices on these lines are serial
+ * polled. When no configured line responds, all devices are polled.
+ */
+void Controller::srqService() {
+  uint8_t addrs[31];
+  uint8_t sa;
+  uint8_t n_addr = srqDevices(addrs, sa);
+
+  spollAddrs(addrs, n_addr, sa, 2);
+}
+
+
+/***** Select the devices to serial poll for a service request *****/
+/*
+ * In SRQ auto mode 2, the devices configured on the lines that respond
+ * to a parallel poll (all devices if none); otherwise the addressed
+ * device, with its secondary address in sa.
+ */
+uint8_t Controller::srqDevices(uint8_t *addrs, uint8_t &sa) {
+  uint8_t n_addr = 0;
+  uint32_t devs = 0;
+
+  sa = 0;
+  if (srqaMode != 2) {
+    addrs[n_addr++] = config.paddr;
+    sa = config.saddr;
+    return n_addr;
+  }
+
+  uint8_t pb = gpib->parallelPoll();
+  for (uint8_t i = 0; i < 8; i++) {
+    if (pb & (1 << i)) devs |= ppLines[i];
+  }
+  // No configured device responded: poll all of them
+  if (devs == 0) devs = 0x7FFFFFFFUL;
+
+  for (uint8_t a = 0; a < 31; a++) {
+    if ((devs & (1UL << a)) && (a != config.caddr)) addrs[n_addr++] = a;
+  }
+  return n_addr;
+}
+
+
+/***** Report the service requests queued by the SRQ interrupt *****/
+/*
+ * For each assertion of SRQ, the devices selected by srqDevices() are
+ * serial polled and each one with RQS set is reported on the command
+ * stream as SRQ:<addr>,<status>,<t_us>, where t_us is the time (micros)
+ * at which SRQ was asserted. Unless srqaMode is 2, only the addressed
+ * device is polled: the requests of the other devices are not reported.
+ */
+void Controller::srqEvents() {
+  uint8_t addrs[31];
+  int16_t stb[31];
+  uint8_t sa;
+  uint8_t n;
+  uint32_t t;
+
+  while (gpib->popSrqEvent(t)) {
+    n = srqDevices(addrs, sa);
+    if (gpib->serialPoll(addrs, n, sa, stb, false)) continue;
+    for (uint8_t i = 0; i < n; i++) {
+      if ((stb[i] >= 0) && (stb[i] & 0x40)) {
+        cmdstream->print(F("SRQ:"));
+        cmdstream->print(addrs[i]);
+        cmdstream->print(F(","));
+        cmdstream->print(stb[i], DEC);
+        cmdstream->print(F(","));
+        cmdstream->println(t);
+      }
     }
-    if (config.isVerb) cmdstream->println(isSrqa ? "SRQ auto ON" : "SRQ auto OFF") ;
+  }
+}
+
+
+/***** Enable or disable SRQ event reports *****/
+void Controller::srqevt_h(char *params) {
+  uint16_t val;
+  uint32_t t;
+  if (params != NULL) {
+    if (notInRange(params, 0, 1, val)) return;
+    // Forget the requests that came before
+    if (val) while (gpib->popSrqEvent(t));
+    srqEvt = val;
+    if (config.isVerb) cmdstream->println(srqEvt ? "SRQ events ON" : "SRQ events OFF") ;
   } else {
-    cmdstream->println(isSrqa);
+    cmdstream->println(srqEvt);
   }
 }
 
@@ -1202,8 +1558,24 @@ void Controller::xdiag_h(char *params){
 /****** Timing parameters ******/
 
 void Controller::tmbus_h(char *params) {
+  char *param;
   uint16_t val;
-  if (params != NULL) {
+  uint16_t sa = 0;
+  if ((params != NULL) && (strncmp(params, "auto", 4) == 0)) {
+    // Calibrate for the device at the given address
+    if (config.cmode != 2) {
+      errBadCmd();
+      return;
+    }
+    if (notInRange(strtok(params + 4, " \t"), 0, 30, val)) return;
+    if (val == config.caddr) {
+      errBadCmd();
+      return;
+    }
+    param = strtok(NULL, " \t");
+    if ((param != NULL) && notInRange(param, 96, 126, sa)) return;
+    tmbusCalibrate(val, sa);
+  } else if (params != NULL) {
     if (notInRange(params, 0, 30000, val)) return;
     config.tmbus = val;
     if (config.isVerb) {
@@ -1216,6 +1588,141 @@ void Controller::tmbus_h(char *params) {
 }
 
 
+/***** Find the smallest working bus delay for a device *****/
+/*
+ * *IDN? is sent to the device with the TMBUS_CAL_MAX delay to get a
+ * reference response, then TMBUS_CAL_RUNS times at each step, from that
+ * delay and halving it, as long as all the responses match the reference. The smallest
+ * working delay plus a 25% margin is kept (in the device profile when
+ * profiles are enabled) and reported with the transfer rate measured
+ * again at the delay kept. The transfer settings of the device (its profile, if
+ * any) are used during the calibration. The device is then sent SDC, as
+ * the step that failed may have left part of a query in its buffer.
+ */
+#define TMBUS_CAL_RUNS 3
+#define TMBUS_CAL_BUFSIZE 64
+#define TMBUS_CAL_MAX 1000
+
+void Controller::tmbusCalibrate(uint8_t addr, uint8_t sa) {
+  char query[] = "*IDN?";
+  uint8_t ref[TMBUS_CAL_BUFSIZE];
+  uint8_t buf[TMBUS_CAL_BUFSIZE];
+  uint8_t refLen = 0;
+  uint8_t len;
+  uint16_t tm;
+  uint16_t safe;
+  bool ok = true;
+  uint8_t i;
+  unsigned long tstart;
+  unsigned long bps = 0;
+
+  // Save the settings of the currently selected device
+  uint8_t paddr = config.paddr;
+  uint8_t saddr = config.saddr;
+  bool eoi = config.eoi;
+  uint8_t eos = config.eos;
+  uint8_t eor = config.eor;
+  int rtmo = config.rtmo;
+  uint16_t tmbus = config.tmbus;
+
+  config.paddr = addr;
+  config.saddr = sa;
+#ifdef USE_PROFILES
+  applyProfile(addr);
+#endif
+  safe = TMBUS_CAL_MAX;
+  config.tmbus = safe;
+
+  // Reference response
+  gpib->rEoi = false;
+  gpib->rEbt = false;
+  gpib->rBlk = false;
+  gpib->rCnt = 0;
+  if (gpib->gpibQueryCapture(query, strlen(query), ref, sizeof(ref), refLen)) refLen = 0;
+  if (refLen == 0) ok = false;
+
+  // Lower the delay while the device still answers correctly
+  tm = safe;
+  while (ok) {
+    config.tmbus = tm;
+    for (i = 0; i < TMBUS_CAL_RUNS; i++) {
+      if (gpib->gpibQueryCapture(query, strlen(query), buf, sizeof(buf), len) ||
+          (len != refLen) || (memcmp(buf, ref, len) != 0)) {
+        ok = false;
+        break;
+      }
+    }
+    if (!ok) break;
+    safe = tm;
+    if (config.isVerb) {
+      cmdstream->print(F("tmbus "));
+      cmdstream->print(tm);
+      cmdstream->println(F(" OK"));
+    }
+    if (tm == 0) break;
+    tm = tm / 2;
+  }
+  // Keep a margin above the smallest working delay
+  safe = safe + safe / 4;
+  config.tmbus = safe;
+
+  // The failed step may have left part of a query in the device: clear it
+  if (!ok) {
+    if (!gpib->addrDev(addr, sa, 0)) gpib->gpibSendCmd(GC_SDC);
+    gpib->uaddrDev();
+    gpib->setGpibControls(CIDS);
+  }
+
+  // Transfer rate at the delay kept (correct responses only)
+  if (refLen > 0) {
+    tstart = micros();
+    for (i = 0; i < TMBUS_CAL_RUNS; i++) {
+      if (gpib->gpibQueryCapture(query, strlen(query), buf, sizeof(buf), len) ||
+          (len != refLen) || (memcmp(buf, ref, len) != 0)) break;
+    }
+    bps = (unsigned long)refLen * i * 1000000UL / (micros() - tstart + 1);
+  }
+
+  // Only the reference failing is an error
+  ok = (refLen > 0);
+
+  // Restore the settings of the selected device
+  config.paddr = paddr;
+  config.saddr = saddr;
+  config.eoi = eoi;
+  config.eos = eos;
+  config.eor = eor;
+  config.rtmo = rtmo;
+  config.tmbus = tmbus;
+  gpib->setTerminator();
+
+  if (!ok) {
+    errBadCmd();
+    if (config.isVerb) cmdstream->println(F("No response from the device"));
+    return;
+  }
+
+#ifdef USE_PROFILES
+  AR488Profile *prof = &profiles[addr];
+  if (!prof->valid) {
+    // New profile with the settings used for the calibration
+    prof->valid = true;
+    prof->eoi = eoi;
+    prof->eos = eos;
+    prof->eor = eor;
+    prof->rtmo = rtmo;
+  }
+  prof->tmbus = safe;
+#endif
+  if ((addr == paddr) && (sa == saddr)) config.tmbus = safe;
+
+  // Report: delay, bytes per second
+  cmdstream->print(safe);
+  cmdstream->print(F(" "));
+  cmdstream->println(bps);
+}
+
+
 /***** Set device ID *****/
 /*
  * Sets the device ID parameters including:
@@ -1338,10 +1845,12 @@ void Controller::idn_h(char * params){
 */
 bool Controller::notInRange(char *param, uint16_t lowl, uint16_t higl, uint16_t &rval) {
 
-  // Null string passed?
-  if (param == NULL) return true;
-  // Empty string passed?
-  if (strlen(param) == 0) return true;
+  // Null or empty string passed: parameter missing
+  if ((param == NULL) || (strlen(param) == 0)) {
+    errBadCmd();
+    if (config.isVerb) cmdstream->println(F("Missing parameter"));
+    return true;
+  }
 
   // Convert to integer
   rval = 0;
@@ -1460,28 +1969,40 @@ static const char cmdHelp[] PROGMEM = {
   "ver: Display firmware version\n"
   // additional commands
   "== Extension command set ==\n"
+  "addr_tmo_us: Timeout for each addressing command byte (1 - 60000 microseconds)\n"
+  "addrcache: Only send addressing commands when the addressed device changes (0=off; 1=on)\n"
   "allspoll: Serial poll all instruments (alias: ++spoll all)\n"
+  "byte_tmo_ms: Timeout for the next byte and the handshake of each byte (1 - 32000 milliseconds)\n"
   "findrqs: Find device requesting service\n"
   "findlstn: Find all devices listening on the GPIB bus\n"
+  "flush_tmo_ms: Maximum delay before received data is sent (0 - 1000 milliseconds)\n"
   "dcl: Send unaddressed (all) device clear  [power on reset] (is the rst?)\n"
   "default: Set configuration to controller default settings\n"
   "id name: Show/Set the name of the interface\n"
   "id serial: Show/Set the serial number of the interface\n"
   "id verstr: Show/Set the version string (replaces setvstr)\n"
   "idn: Enable/Disable reply to *idn? (disabled by default)\n"
+  "lstn_tmo_us: Timeout to detect a listener (1 - 60000 microseconds)\n"
 #ifdef USE_MACROS
   "macro: List defined macros\n"
   "macro <n>: Execute macro number <n>\n"
   "macro <n> set: Edit macro number <n>\n"
   "macro <n> del: Delete macro number <n>\n"
 #endif
+  "ppconf: Configure the parallel poll response of a device (addr line sense | addr off)\n"
   "ppoll: Conduct a parallel poll\n"
+  "ppu: Unconfigure parallel poll of all devices or of the given device\n"
+#ifdef USE_PROFILES
+  "profile: Show/set/clear the settings applied when the device is selected with ++addr\n"
+#endif
+  "query: Send a query to the instrument and read the response\n"
   "ren: Assert or Unassert the REN signal\n"
   "repeat: Repeat a given command and return result\n"
   "setvstr: Set custom version string (to identify controller, e.g. \"GPIB-USB\"). Max 47 chars, excess truncated.\n"
-  "srqauto: Automatically conduct serial poll when SRQ is asserted\n"
+  "srqauto: Automatically conduct serial poll when SRQ is asserted (2=parallel poll first)\n"
+  "srqevt: Report service requests as SRQ:addr,status,time_us (0=off; 1=on)\n"
   "ton: Put controller in talk-only mode (send data only)\n"
-  "tmbus: Timing parameters (see the doc)\n"
+  "tmbus: Timing parameters (see the doc); auto <addr> [saddr] calibrates it for a device\n"
   "verbose: Verbose (human readable) mode\n"
 #ifdef AR488_WIFI_ENABLE
   "wifi ssid: Set or get the wifi SSID (31 chars max)\n"
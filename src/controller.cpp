@@ -20,6 +20,17 @@
 #include "macros.h"
 #endif
 
+#if defined(USE_PROFILES) && !defined(ESP32) && defined(E2END)
+// Profiles are stored in EEPROM after the configuration and the macros
+static int addressForProfiles() {
+  int addr = EESTART + sizeof(AR488Conf);
+#ifdef USE_MACROS
+  addr += (2 + MACRO_MAX_LEN) * NUM_MACROS;
+#endif
+  return addr;
+}
+#endif
+
 // TODO: dbSerial
 
 /*
@@ -77,9 +88,13 @@
    ++id verstr    - show/set the version string (replaces setvstr)
    ++idn          - enable/disable reply to *idn? (disabled by default)
    ++ren          - assert or unassert the REN signal
+   ++ppconf       - configure the parallel poll response of a device
    ++ppoll        - conduct a parallel poll
+   ++ppu          - unconfigure parallel poll
+   ++profile      - show/set/clear the settings applied when selecting the device with ++addr
    ++setvstr      - set custom version string (to identify controller, e.g. "GPIB-USB"). Max 47 chars, excess truncated.
-   ++srqauto      - automatically condiuct serial poll when SRQ is asserted
+   ++srqauto      - automatically condiuct serial poll when SRQ is asserted (2=parallel poll first)
+   ++srqevt       - report service requests with the time SRQ was asserted
    ++ton          - put controller in talk-only mode (send data only)
    ++verbose      - verbose (human readable) mode
 */
@@ -93,9 +108,9 @@
 
 
 Controller::Controller():
-	serialstream(NULL), btstream(NULL), tcpstream(NULL)
+	serialstream(NULL), btstream(NULL)
 #ifdef AR488_WIFI_ENABLE
-	, wifimulti(), wifiserver(23), serverclient()
+	, wifimulti(), wifiserver(23)
 #endif
 {
   serialstream = getSerialStream();
@@ -103,15 +118,38 @@ Controller::Controller():
 #ifdef AR488_BT_ENABLE
   btstream = getBTSerialStream();
 #endif
+#ifdef USE_SESSIONS
+  memset(sessions, 0, sizeof(sessions));
+  sessions[0].stream = serialstream;
+  input = &sessions[0].input;
+#else
+  memset(&inputBuf, 0, sizeof(inputBuf));
+  input = &inputBuf;
+#endif
 }
 
-/***** Add character to the buffer and parse *****/
-uint8_t Controller::parseInput(char c) {
+/***** Add character to the buffer of an input *****/
+static void addChar(AR488Input *p, char c) {
+  p->pBuf[p->pbPtr] = c;
+  p->pbPtr++;
+}
+
+
+/***** Clear the buffer of an input *****/
+static void clearInput(AR488Input *p) {
+  memset(p->pBuf, '\0', PBSIZE);
+  p->pbPtr = 0;
+  p->dataBufferFull = false;
+}
+
+
+/***** Add character to the buffer of an input and parse *****/
+uint8_t Controller::parseInput(AR488Input *p, char c) {
 
   uint8_t r = 0;
 
   // Read until buffer full (buffer-size - 2 characters)
-  if (pbPtr < PBSIZE) {
+  if (p->pbPtr < PBSIZE) {
     // Actions on specific characters
     switch (c) {
       // Carriage return or newline? Then process the line
@@ -120,85 +158,85 @@ uint8_t Controller::parseInput(char c) {
 		break;
       case CR:
         // If escaped just add to buffer
-        if (isEsc) {
-          addPbuf(c);
-          isEsc = false;
+        if (p->isEsc) {
+          addChar(p, c);
+          p->isEsc = false;
         } else {
           // Carriage return on blank line?
           // Note: for data CR and LF will always be escaped
-          if (pbPtr == 0) {
+          if (p->pbPtr == 0) {
 #ifdef USE_MACROS
 			if (editMacro < NUM_MACROS) {
-			  flushPbuf();
+			  clearInput(p);
 			  return 4;  //
 			}
 #endif
-            flushPbuf();
+            clearInput(p);
             return 0;
           } else {
             // Buffer starts with ++ and contains at least 3 characters - command?
-            if (pbPtr>2 && isCmd(pBuf) && !isPlusEscaped) {
+            if (p->pbPtr>2 && isCmd(p->pBuf) && !p->isPlusEscaped) {
               // Exclamation mark (break read loop command)
-              if (pBuf[2]==0x21) {
+              if (p->pBuf[2]==0x21) {
                 r = 3;
-                flushPbuf();
+                clearInput(p);
               // Otherwise flag command received and ready to process
               }else{
                 r = 1;
               }
             // Buffer contains *idn? query and interface to respond
-            }else if (pbPtr>3 && config.idn>0 && isIdnQuery(pBuf)){
+            }else if (p->pbPtr>3 && config.idn>0 && isIdnQuery(p->pBuf)){
               sendIdn = true;
-              flushPbuf();
+              clearInput(p);
             // Buffer has at least 1 character = instrument data to send to gpib bus
-            }else if (pbPtr > 0) {
+            }else if (p->pbPtr > 0) {
               r = 2;
             }
-            isPlusEscaped = false;
+            p->isPlusEscaped = false;
           }
         }
         break;
       case ESC:
         // Handle the escape character
-        if (isEsc) {
+        if (p->isEsc) {
           // Add character to buffer and cancel escape
-          addPbuf(c);
-          isEsc = false;
+          addChar(p, c);
+          p->isEsc = false;
         } else {
           // Set escape flag
-          isEsc  = true;  // Set escape flag
+          p->isEsc  = true;  // Set escape flag
         }
         break;
       case PLUS:
-        if (isEsc) {
-          isEsc = false;
-          if (pbPtr < 2) isPlusEscaped = true;
+        if (p->isEsc) {
+          p->isEsc = false;
+          if (p->pbPtr < 2) p->isPlusEscaped = true;
         }
-        addPbuf(c);
+        addChar(p, c);
         break;
 	  case BS:
-        if (isEsc) {
-          addPbuf(c);
-          isEsc = false;
+        if (p->isEsc) {
+          addChar(p, c);
+          p->isEsc = false;
 		} else {
-			pbPtr--;
+			p->pbPtr--;
 		}
 		break;
       // Something else?
       default: // any char other than defined above
         // Buffer contains '++' (start of command). Stop sending data to serial port by halting GPIB receive.
-        addPbuf(c);
-        isEsc = false;
+        addChar(p, c);
+        p->isEsc = false;
     }
   }
-  if (pbPtr >= PBSIZE) {
-    if (isCmd(pBuf) && !r) {  // Command without terminator and buffer full
+  if (p->pbPtr >= PBSIZE) {
+    if (isCmd(p->pBuf) && !r) {  // Command without terminator and buffer full
       if (verbose()) {
         cmdstream->println(F("ERROR - Command buffer overflow!"));
       }
-      flushPbuf();
+      clearInput(p);
     }else{  // Buffer contains data and is full, so process the buffer (send data via GPIB)
-      dataBufferFull = true;
+      p->dataBufferFull = true;
       r = 2;
     }
   }
@@ -233,17 +271,18 @@ bool Controller::isIdnQuery(char *buffr) {
 
 /***** Add character to the buffer *****/
 void Controller::addPbuf(char c) {
-  pBuf[pbPtr] = c;
-  pbPtr++;
+  addChar(input, c);
 }
 
 
 /***** Clear the parse buffer *****/
 void Controller::flushPbuf() {
-  memset(pBuf, '\0', PBSIZE);
-  pbPtr = 0;
+  clearInput(input);
   lnRdy = 0;
-  dataBufferFull = false;
+#ifdef USE_SESSIONS
+  // Line done: the session parses its input again
+  sessions[curSession].lnRdy = 0;
+#endif
 }
 
 
@@ -272,10 +311,14 @@ void Controller::showPrompt() {
  * lnRdy=4: terminator detected, sequence in parse buffer is line of the currently edited macro
  */
 uint8_t Controller::serialIn_h() {
+#ifdef USE_SESSIONS
+  // Each session has its own input, lines are dispatched by selectStream()
+  return parseSessions();
+#else
   uint8_t bufferStatus = 0;
   // Parse serial input until we have detected a line terminator
   while (cmdstream->available() && bufferStatus==0) {   // Parse while characters available and line is not complete
-	bufferStatus = parseInput(cmdstream->read());
+	bufferStatus = parseInput(input, cmdstream->read());
   }
 
 #ifdef DEBUG1
@@ -292,6 +335,18 @@ uint8_t Controller::serialIn_h() {
 	lnRdy = 4;
 #endif
   return lnRdy;
+#endif
+}
+
+
+/***** Reply to *idn? (see parseInput()) *****/
+void Controller::idnReply(Stream *stream) {
+  if (config.idn==1) stream->println(config.sname);
+  if (config.idn==2) {
+	stream->print(config.sname);
+	stream->print("-");
+	stream->println(config.serial);
+  }
 }
 
 
@@ -316,7 +371,7 @@ void Controller::reset() {
 
 void Controller::resetConfig() {
   // Set default values ({'\0'} sets version string array to null)
-  config = {false, false, 2, 0, 1, 0, 0, 0, 0, 1200, 0, {'\0'}, 0, 0, {'\0'}, 0, 0, false, false
+  config = {false, false, 2, 0, 1, 0, 0, 0, 0, 1200, 0, {'\0'}, 0, 0, {'\0'}, 0, 0, false, false, false, 5, {0}, 0, 10000, 200, 1500
 #ifdef AR488_WIFI_ENABLE
 			,{'\0'}, {'\0'}
 #endif
@@ -327,6 +382,9 @@ void Controller::initConfig()
 {
   /***** Initialise the interface *****/
   resetConfig();
+#ifdef USE_PROFILES
+  clearProfiles();
+#endif
 #ifdef ESP32
   Preferences pref;
   pref.begin("ar488", true);
@@ -347,12 +405,26 @@ void Controller::initConfig()
   config.idn = pref.getUInt("idn", config.idn);
   config.isVerb = pref.getBool("isVerb", config.isVerb);
   config.showPrompt = pref.getBool("showPrompt", config.showPrompt);
+  config.addrcache = pref.getBool("addrcache", config.addrcache);
+  config.oflush = pref.getUShort("oflush", config.oflush);
+  config.eorlen = pref.getUChar("eorlen", config.eorlen);
+  config.atmo = pref.getUShort("atmo", config.atmo);
+  config.btmo = pref.getUShort("btmo", config.btmo);
+  config.ltmo = pref.getUShort("ltmo", config.ltmo);
+  if (pref.isKey("eorseq")) {
+	pref.getBytes("eorseq", config.eorseq, TERM_MAXLEN);
+  }
   if (pref.isKey("vstr")) {
 	pref.getBytes("vstr", config.vstr, 48);
   }
   if (pref.isKey("sname")) {
 	pref.getBytes("sname", config.sname, 16);
   }
+#ifdef USE_PROFILES
+  if (pref.getBytesLength("profiles") == sizeof(profiles)) {
+	pref.getBytes("profiles", profiles, sizeof(profiles));
+  }
+#endif
 #ifdef AR488_WIFI_ENABLE
   if (pref.isKey("ssid")) {
 	pref.getBytes("ssid", config.ssid, 64);
@@ -370,6 +442,11 @@ void Controller::initConfig()
   if (!epGet(0, config)) {
 	resetConfig();
   }
+#ifdef USE_PROFILES
+  if (!epGet(addressForProfiles(), profiles)) {
+	clearProfiles();
+  }
+#endif
 #endif
 
   /*
@@ -388,6 +465,10 @@ void Controller::initConfig()
   gpib->clearATN();
   gpib->clearSRQ();
 
+#if defined(USE_SESSIONS) && defined(AR488_BT_ENABLE)
+  // Bluetooth console (unless it shares the serial port)
+  if ((btstream != NULL) && (btstream != serialstream)) openSession(AR_BT_SESSION, btstream);
+#endif
 }
 
 void Controller::saveConfig()
@@ -399,6 +480,13 @@ void Controller::saveConfig()
   pref.putBool("eoi", config.eoi);
   pref.putBool("isVerb", config.isVerb);
   pref.putBool("showPrompt", config.showPrompt);
+  pref.putBool("addrcache", config.addrcache);
+  pref.putUShort("oflush", config.oflush);
+  pref.putUChar("eorlen", config.eorlen);
+  pref.putBytes("eorseq", config.eorseq, TERM_MAXLEN);
+  pref.putUShort("atmo", config.atmo);
+  pref.putUShort("btmo", config.btmo);
+  pref.putUShort("ltmo", config.ltmo);
   pref.putUChar("cmode", config.cmode);
   pref.putUChar("caddr", config.caddr);
   pref.putUChar("paddr", config.paddr);
@@ -415,6 +503,9 @@ void Controller::saveConfig()
 
   pref.putBytes("vstr", config.vstr, 48);
   pref.putBytes("sname", config.sname, 16);
+#ifdef USE_PROFILES
+  pref.putBytes("profiles", profiles, sizeof(profiles));
+#endif
 
 #ifdef AR488_WIFI_ENABLE
   pref.putBytes("ssid", config.ssid, 64);
@@ -426,6 +517,9 @@ void Controller::saveConfig()
 
 #elif defined(E2END)
   epPut(0, config);
+#ifdef USE_PROFILES
+  epPut(addressForProfiles(), profiles);
+#endif
   if (verbose()) cmdstream->println(F("Settings saved."));
 
 #else
@@ -436,20 +530,40 @@ void Controller::saveConfig()
 void Controller::sendToInstrument()
 {
   if (isRO) return;
-  if (pbPtr == 0) return;
-  if (pBuf[pbPtr-1] == '?') gpib->isQuery = true;
-  gpib->gpibSendData(pBuf, pbPtr, dataBufferFull);
+  if (input->pbPtr == 0) return;
+  if (input->pBuf[input->pbPtr-1] == '?') gpib->isQuery = true;
+  gpib->gpibSendData(input->pBuf, input->pbPtr, input->dataBufferFull);
   flushPbuf();
 }
 
 
+/***** Send the parse buffer to the instrument without blocking *****/
+/*
+ * The transfer is advanced from loop() (see GPIB::xfrStep()) and reads
+ * the response when auto mode requires it. The parse buffer is released
+ * once the data has been written. Controller mode only.
+ */
+void Controller::sendToInstrumentNb()
+{
+  bool read;
+  if (isRO) return;
+  if (input->pbPtr == 0) return;
+  if (input->pBuf[input->pbPtr-1] == '?') gpib->isQuery = true;
+  // Auto-read data following any command, or following a query command
+  read = (config.amode == 1) || ((config.amode == 2) && gpib->isQuery);
+  if (config.amode == 2) gpib->isQuery = false;
+  gpib->xPrompt = true;
+  gpib->xfrSend(input->pBuf, input->pbPtr, input->dataBufferFull, read);
+}
+
+
 /***** Execute a command *****/
 void Controller::execCmd()
 {
   char line[PBSIZE];
-  int dsize = pbPtr;
+  int dsize = input->pbPtr;
   // Copy collected chars to line buffer
-  memcpy(line, pBuf, pbPtr);
+  memcpy(line, input->pBuf, input->pbPtr);
 
   // Flush the parse buffer
   flushPbuf();
@@ -471,7 +585,12 @@ void Controller::execCmd()
   // Execute the command
   getCmd(line);
 
-  showPrompt();
+  // A read started by the command shows the prompt when it is done
+  if (gpib->xfrBusy()) {
+    gpib->xPrompt = true;
+  } else {
+    showPrompt();
+  }
 }
 
 #ifdef AR488_WIFI_ENABLE
@@ -506,31 +625,36 @@ void Controller::setupWifi()
 
 void Controller::connectWifi()
 {
+  uint8_t i;
+
   if (WiFi.status() == WL_CONNECTED) {
     //check if there are any new clients
     if (wifiserver.hasClient()) {
-	  if (!serverclient || !serverclient.connected())
-	  {
-		if (serverclient) serverclient.stop();
-		serverclient = wifiserver.available();
-		if (!serverclient)
+	  // Find a free session
+	  for (i = 0; i < AR_TCP_CLIENTS; i++) {
+		if (sessions[AR_TCP_SESSION + i].stream == NULL) break;
+	  }
+	  if (i < AR_TCP_CLIENTS) {
+		clients[i] = wifiserver.available();
+		if (!clients[i])
 		  serialstream->println(F("available broken"));
 		serialstream->print(F("New TCP client: "));
-		serialstream->println(serverclient.remoteIP());
-		tcpstream = (Stream*) &serverclient;
-	  }
-	  else
-	  {
+		serialstream->println(clients[i].remoteIP());
+		openSession(AR_TCP_SESSION + i, (Stream*) &clients[i]);
+	  } else {
         //no free/disconnected spot so reject
         wifiserver.available().stop();
-		tcpstream = NULL;
       }
-    } else {
-	  if (!serverclient.connected() && (cmdstream == (Stream*)&serverclient)) {
-		serverclient.stop();
-		// client got disconnected
-		tcpstream = NULL;
-	  }
+    }
+  }
+
+  // Close the sessions of the clients that got disconnected (the current
+  // one once its GPIB transfer is done)
+  for (i = 0; i < AR_TCP_CLIENTS; i++) {
+	if ((sessions[AR_TCP_SESSION + i].stream != NULL) && !clients[i].connected()) {
+	  if ((curSession == AR_TCP_SESSION + i) && gpib->xfrBusy()) continue;
+	  closeSession(AR_TCP_SESSION + i);
+	  clients[i].stop();
 	}
   }
 }
@@ -579,7 +703,7 @@ void Controller::displayMacros()
 void Controller::appendToMacro()
 {
   String macro;
-  macro = pBuf;
+  macro = input->pBuf;
   macro.trim();
 
   if (macro.length() > 0)
@@ -603,37 +727,210 @@ void Controller::appendToMacro()
 
 #endif
 
+/***** Dispatch the next line to process *****/
+/*
+ * Every stream has a session with its own input (see parseSessions()).
+ * Once the GPIB transfer and the line of the current session are done,
+ * the session of the next complete line, in the order the lines were
+ * completed, becomes current: its line is processed and the replies go
+ * to its stream. Sessions in continuous read mode (++auto 3) take turns
+ * when there is no line to process.
+ */
 void Controller::selectStream()
 {
+#ifdef USE_SESSIONS
+  uint8_t idx;
+
 #ifdef AR488_WIFI_ENABLE
   // check for new tcp cnx
   if (strlen(config.ssid) > 0)
 	connectWifi();
 #endif
-  Stream *current = cmdstream;
 
-  String nextstream = "";
-  if (serialstream->available()) {
-	if (cmdstream != serialstream) {
-	  nextstream = "serial";
-	  cmdstream = serialstream;
+  parseSessions();
+
+  if (gpib->xfrBusy() || (lnRdy != 0)) return;
+
+  if (lineQLen > 0) {
+	// Next line in the queue
+	idx = lineQ[0];
+	lineQLen--;
+	memmove(lineQ, lineQ + 1, lineQLen);
+	if (idx != curSession) switchSession(idx);
+	lnRdy = sessions[idx].lnRdy;
+  } else {
+	// Next session in continuous read mode
+	idx = curSession;
+	for (uint8_t n = 1; n < AR_SESSIONS; n++) {
+	  idx = (idx + 1) % AR_SESSIONS;
+	  if ((sessions[idx].stream != NULL) && sessions[idx].aRead) {
+		switchSession(idx);
+		break;
+	  }
 	}
   }
-  else if ((btstream != NULL) &&  btstream->available()) {
-	if (cmdstream != btstream) {
-	  nextstream = "BT";
-	  cmdstream = btstream;
+#endif
+}
+
+
+/***** Lines waiting to be processed (see selectStream()) *****/
+/*
+ * A continuous read (++auto 3) is not restarted while there are any, so
+ * that it does not hold the bus against the other sessions.
+ */
+bool Controller::linesQueued()
+{
+#ifdef USE_SESSIONS
+  return (lineQLen > 0);
+#else
+  return false;
+#endif
+}
+
+
+#ifdef USE_SESSIONS
+/***** Parse the input of every session *****/
+/*
+ * A complete line is queued for dispatch (see selectStream()) and the
+ * session is not parsed any further until the line has been processed:
+ * the next lines wait in the stream. A line of the current session
+ * breaks the read in progress when allowed.
+ * Returns the status of the line completed by the current session.
+ */
+uint8_t Controller::parseSessions()
+{
+  AR488Session *s;
+  uint8_t status;
+  uint8_t r = 0;
+
+  for (uint8_t i = 0; i < AR_SESSIONS; i++) {
+	s = &sessions[i];
+	if ((s->stream == NULL) || (s->lnRdy > 0)) continue;
+
+	// Parse while characters available and line is not complete
+	status = 0;
+	while (s->stream->available() && (status == 0)) {
+	  status = parseInput(&s->input, s->stream->read());
 	}
-  }
-  else if ((tcpstream != NULL) &&  tcpstream->available()) {
-	if (cmdstream != tcpstream) {
-	  nextstream = "TCP";
-	  cmdstream = tcpstream;
+
+	// *idn? is answered to the stream that sent it
+	if (sendIdn) {
+	  idnReply(s->stream);
+	  sendIdn = false;
+	}
+
+	if (status == 0) continue;
+#if defined(USE_MACROS)
+	// we have a parsed line, and a macro being edited
+	if (editMacro < NUM_MACROS) status = 4;
+#endif
+
+	if (i == curSession) {
+	  r = status;
+	  if (gpib->xfrBreakable()) {
+		gpib->tranBrk = 1;
+		aRead = false;  // Stop auto read
+	  }
 	}
+
+	// Break (++!): nothing else to do
+	if (status == 3) continue;
+
+	s->lnRdy = status;
+	lineQ[lineQLen++] = i;
+  }
+  return r;
+}
+
+
+/***** Open the session of a new client *****/
+/*
+ * The client starts with the settings of the serial console.
+ */
+void Controller::openSession(uint8_t idx, Stream *stream)
+{
+  AR488Session *s = &sessions[idx];
+
+  memset(s, 0, sizeof(AR488Session));
+  s->stream = stream;
+  if (curSession == 0) {
+	getSessionConf(s->conf);
+  } else {
+	s->conf = sessions[0].conf;
   }
+}
+
+
+/***** Close the session of a client *****/
+void Controller::closeSession(uint8_t idx)
+{
+  uint8_t i;
 
-  if (nextstream.length() > 0) {
-	current->println("Moving serial console to " + nextstream);
-	showPrompt();
+  // Back to the serial console
+  if (curSession == idx) {
+	lnRdy = 0;
+	switchSession(0);
+  }
+
+  // Drop its line from the queue
+  for (i = 0; i < lineQLen; i++) {
+	if (lineQ[i] == idx) {
+	  lineQLen--;
+	  memmove(lineQ + i, lineQ + i + 1, lineQLen - i);
+	  break;
+	}
   }
+  sessions[idx].stream = NULL;
+  sessions[idx].lnRdy = 0;
 }
+
+
+/***** Make a session current *****/
+/*
+ * The settings of the current session are parked and replaced by those
+ * of session idx.
+ */
+void Controller::switchSession(uint8_t idx)
+{
+  AR488Session *s = &sessions[curSession];
+
+  // Park the current session
+  s->aRead = aRead;
+  getSessionConf(s->conf);
+
+  // Restore session idx
+  s = &sessions[idx];
+  cmdstream = s->stream;
+  input = &s->input;
+  aRead = s->aRead;
+  setSessionConf(s->conf);
+  curSession = idx;
+}
+
+
+/***** Session settings from/to the configuration *****/
+void Controller::getSessionConf(AR488SessionConf &conf)
+{
+  conf.paddr = config.paddr;
+  conf.saddr = config.saddr;
+  conf.amode = config.amode;
+  conf.eos = config.eos;
+  conf.eor = config.eor;
+  conf.eoi = config.eoi;
+  conf.rtmo = config.rtmo;
+  conf.tmbus = config.tmbus;
+}
+
+void Controller::setSessionConf(const AR488SessionConf &conf)
+{
+  config.paddr = conf.paddr;
+  config.saddr = conf.saddr;
+  config.amode = conf.amode;
+  config.eos = conf.eos;
+  config.eor = conf.eor;
+  config.eoi = conf.eoi;
+  config.rtmo = conf.rtmo;
+  config.tmbus = conf.tmbus;
+  gpib->setTerminator();
+}
+#endif
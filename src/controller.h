@@ -5,6 +5,7 @@
 //#include <ArduinoSTL.h>
 //#include <map>
 #include "AR488.h"
+#include "terminator.h"
 //#include "gpib.h"
 
 #ifdef AR488_WIFI_ENABLE
@@ -34,12 +35,19 @@ typedef struct {
   char eot_ch;      // EOT character to append to USB output when EOI signal detected
   char vstr[48];    // Custom version string
   uint16_t tmbus;   // Delay to allow the bus control/data lines to settle (1-30,000 microseconds)
-  uint8_t eor;      // EOR (end of receive from GPIB instrument) characters [0=CRLF, 1=CR, 2=LF, 3=None, 4=LFCR, 5=ETX, 6=CRLF+ETX, 7=SPACE]
+  uint8_t eor;      // EOR (end of receive from GPIB instrument) characters [0=CRLF, 1=CR, 2=LF, 3=None, 4=LFCR, 5=ETX, 6=CRLF+ETX, 7=SPACE, 8=custom]
   char sname[16];   // Interface short name
   uint32_t serial;  // Serial number
   uint8_t idn;      // Send ID in response to *idn? 0=disable, 1=send name; 2=send name+serial
   bool isVerb;      // Verbose mode
   bool showPrompt;  // Show a prompt (when ready to accept commands)
+  bool addrcache;   // Only send addressing commands when the talker/listener changes
+  uint16_t oflush;  // Deadline (ms) to flush received data staged for output (0=no staging)
+  uint8_t eorseq[TERM_MAXLEN];  // Custom EOR sequence (eor=8)
+  uint8_t eorlen;   // Custom EOR sequence length
+  uint16_t atmo;    // Addressing (command byte) handshake timeout in microseconds
+  uint16_t btmo;    // Inter-byte and byte handshake timeout in milliseconds
+  uint16_t ltmo;    // Listener detection timeout in microseconds
 #ifdef AR488_WIFI_ENABLE
   char ssid[32];    // max size for WiFiMulti.addAp is 31
   char passkey[64]; // same
@@ -47,10 +55,92 @@ typedef struct {
 } AR488Conf;
 
 
+/***** Input parse context *****/
+/*
+ * Parse state of the input of a stream, see parseInput()
+ */
+typedef struct {
+  char pBuf[PBSIZE];
+  uint8_t pbPtr;
+  bool dataBufferFull;
+  bool isEsc;           // Charcter escaped
+  bool isPlusEscaped;   // Plus escaped
+} AR488Input;
+
+
+/***** Sessions: serial, Bluetooth, TCP clients *****/
+#ifdef AR488_WIFI_ENABLE
+  #define AR_TCP_SESSIONS AR_TCP_CLIENTS
+#else
+  #define AR_TCP_SESSIONS 0
+#endif
+#ifdef AR488_BT_ENABLE
+  #define AR_BT_SESSION 1
+  #define AR_TCP_SESSION 2      // First TCP client session
+#else
+  #define AR_TCP_SESSION 1
+#endif
+#define AR_SESSIONS (AR_TCP_SESSION + AR_TCP_SESSIONS)
+#if AR_SESSIONS > 1
+  #define USE_SESSIONS
+#endif
+
+
+#ifdef USE_SESSIONS
+/***** Session settings *****/
+/*
+ * Prologix settings kept for each session, with the read timeout and
+ * bus delay of its device (which may come from the device profile)
+ */
+typedef struct {
+  uint8_t paddr;    // config.paddr
+  uint8_t saddr;    // config.saddr
+  uint8_t amode;    // config.amode
+  uint8_t eos;      // config.eos
+  uint8_t eor;      // config.eor
+  bool eoi;         // config.eoi
+  int rtmo;         // config.rtmo
+  uint16_t tmbus;   // config.tmbus
+} AR488SessionConf;
+
+
+/***** Client session *****/
+/*
+ * Input and settings of a stream: session 0 is the serial console, then
+ * come the Bluetooth console (AR_BT_SESSION) and the TCP clients (from
+ * AR_TCP_SESSION). The settings of the current session are held by the
+ * Controller members and config, those of the others are parked here.
+ */
+typedef struct {
+  Stream *stream;   // Client stream (NULL=session closed)
+  AR488Input input; // Parse state
+  uint8_t lnRdy;    // Complete line waiting for dispatch (parseInput() status, 0=none)
+  bool aRead;
+  AR488SessionConf conf;
+} AR488Session;
+#endif
+
+
+#ifdef USE_PROFILES
+/***** Device profile *****/
+/*
+ * Transfer settings of the device at an address, applied by ++addr
+ */
+typedef struct {
+  bool valid;       // A profile is set for this address
+  bool eoi;         // config.eoi
+  uint8_t eos;      // config.eos
+  uint8_t eor;      // config.eor
+  uint16_t rtmo;    // config.rtmo
+  uint16_t tmbus;   // config.tmbus
+} AR488Profile;
+#endif
+
+
 class Controller {
 public:
   Controller();
-  uint8_t parseInput(char c);
+  uint8_t parseInput(AR488Input *p, char c);
   bool isCmd(char *buffr);
   bool isIdnQuery(char *buffr);
   void addPbuf(char c);
@@ -63,7 +153,9 @@ public:
   void saveConfig();
   bool verbose() {return config.isVerb;};
   bool prompt() {return config.showPrompt;};
+  void idnReply(Stream *stream);
   void sendToInstrument();
+  void sendToInstrumentNb();
   void setGPIB(GPIB *gpib) {this->gpib = gpib;};
   void execCmd();
 #ifdef AR488_WIFI_ENABLE
@@ -76,12 +168,12 @@ public:
   void appendToMacro();
 #endif
   void selectStream();
+  bool linesQueued();
 
 public:
   AR488Conf config;
   Stream *serialstream;
   Stream *btstream;
-  Stream *tcpstream;
   Stream *cmdstream;
   GPIB *gpib = NULL;
 
@@ -89,7 +181,21 @@ private:
 #ifdef AR488_WIFI_ENABLE
   WiFiMulti wifimulti;
   WiFiServer wifiserver;
-  WiFiClient serverclient;
+  WiFiClient clients[AR_TCP_CLIENTS];
+#endif
+#ifdef USE_SESSIONS
+  AR488Session sessions[AR_SESSIONS];
+  uint8_t curSession = 0;       // Session of cmdstream
+  uint8_t lineQ[AR_SESSIONS];   // Sessions with a complete line, in order of completion
+  uint8_t lineQLen = 0;
+  uint8_t parseSessions();
+  void openSession(uint8_t idx, Stream *stream);
+  void closeSession(uint8_t idx);
+  void switchSession(uint8_t idx);
+  void getSessionConf(AR488SessionConf &conf);
+  void setSessionConf(const AR488SessionConf &conf);
+#else
+  AR488Input inputBuf;
 #endif
 
 /***** PARSE BUFFERS *****/
@@ -98,29 +204,38 @@ private:
  */
 // communication stream input parsing buffer
 public:  // TODO: better than this...
-  char pBuf[PBSIZE];
-  uint8_t pbPtr = 0;
-  bool dataBufferFull = false;
+  AR488Input *input;  // Input of the current session (the line to process)
   uint8_t lnRdy = 0;  // CR/LF terminated line ready to process
   bool aRead = false; // GPIB data read in progress
 
-  // Escaped character flag
-  bool isEsc = false;           // Charcter escaped
-  bool isPlusEscaped = false;   // Plus escaped
   bool isRO = false;            // Read only mode flag
   bool isTO = false;            // Talk only mode flag
-  bool isSrqa = false;          // SRQ auto mode
+  uint8_t srqaMode = 0;         // SRQ auto mode (0=off, 1=serial poll, 2=parallel then serial poll)
+  bool srqEvt = false;          // Report SRQ events (interrupt timestamped)
+  uint32_t ppLines[8] = {0};    // Devices configured to respond on each parallel poll line (bit n = address n)
   uint8_t runMacro = 0;         // Macro to run next loop
   uint8_t editMacro = 255;      // Macro beinf edited
   bool sendIdn = false;         // Send response to *idn?
+#ifdef USE_PROFILES
+  AR488Profile profiles[31];    // Device profiles (index = primary address)
+  void applyProfile(uint8_t addr);
+  void clearProfiles();
+#endif
 
   void getCmd(char *);
   bool notInRange(char*, uint16_t, uint16_t, uint16_t&);
   void errBadCmd();
   void spoll    (char *, int mode);
+  void spollAddrs(uint8_t *addrs, uint8_t n_addr, uint8_t sa, int mode);
+  void srqService();
+  uint8_t srqDevices(uint8_t *addrs, uint8_t &sa);
+  void srqEvents();
+  void ppConfig(uint8_t addr, uint8_t line, uint8_t sense);
+  void tmbusCalibrate(uint8_t addr, uint8_t sa);
 
   // command handlers
   void addr_h     (char *);
+  void addrcache_h(char *);
   void amode_h    (char *);
   void clr_h      (char *);
   void eoi_h      (char *);
@@ -128,6 +243,7 @@ public:  // TODO: better than this...
   void eos_h      (char *);
   void eot_char_h (char *);
   void eot_en_h   (char *);
+  void oflush_h   (char *);
   void help_h     (char *);
   void ifc_h      (char *);
   void llo_h      (char *);
@@ -136,6 +252,9 @@ public:  // TODO: better than this...
   void cmode_h    (char *);
   void read_h     (char *);
   void rtmo_h     (char *);
+  void atmo_h     (char *);
+  void btmo_h     (char *);
+  void ltmo_h     (char *);
   void rst_h      (char *);
   void save_h     (char *);
   void spoll_h    (char *);
@@ -154,12 +273,19 @@ public:  // TODO: better than this...
   void id_h       (char *);
   void idn_h      (char *);
   void macro_h    (char *);
+  void ppconf_h   (char *);
   void ppoll_h    (char *);
+  void ppu_h      (char *);
+#ifdef USE_PROFILES
+  void profile_h  (char *);
+#endif
+  void query_h    (char *);
   void prompt_h   (char *);
   void ren_h      (char *);
   void repeat_h   (char *);
   void setvstr_h  (char *);
   void srqa_h     (char *);
+  void srqevt_h   (char *);
   void tct_h      (char *);
   void ton_h      (char *);
   void tmbus_h    (char *);
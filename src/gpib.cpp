@@ -3,19 +3,25 @@
 #include "AR488_Layouts.h"
 #include "commands.h"
 
+// Interrupt handlers must be in IRAM on ESP32
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
 #ifdef USE_INTERRUPTS
 // ISR handling code for ATN and SRQ interrupts
 // sorry, this is horrible... thanks arduino...
+// (no output from here: the handlers only record the line changes)
 GPIB *_gpib = NULL;
 
-static void ISR_ATN() {
+static void IRAM_ATTR ISR_ATN() {
   if (_gpib != NULL)
-	_gpib->setATN(digitalRead(ATN) == LOW);
+	_gpib->atnChange(digitalRead(ATN) == LOW);
 }
 
-static void ISR_SRQ() {
+static void IRAM_ATTR ISR_SRQ() {
   if (_gpib != NULL)
-	_gpib->setSRQ(digitalRead(SRQ) == LOW);
+	_gpib->srqChange(digitalRead(SRQ) == LOW);
 }
 #endif
 
@@ -59,7 +65,7 @@ void GPIB::initPins(){
 #ifdef USE_INTERRUPTS
   _gpib = this;
   attachInterrupt(digitalPinToInterrupt(ATN), ISR_ATN, CHANGE);
-  attachInterrupt(digitalPinToInterrupt(ATN), ISR_SRQ, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(SRQ), ISR_SRQ, CHANGE);
 #endif
 }
 
@@ -68,9 +74,11 @@ void GPIB::initDevice() {
   initPins();
   // Set GPIB control bus to device idle mode
   setGpibControls(DINI);
+  clearAddrCache();
+  setTerminator();
 
   // Initialise GPIB data lines (sets to INPUT_PULLUP)
-  readGpibDbus();
+  readyGpibDbus();
 }
 
 
@@ -79,8 +87,10 @@ void GPIB::initController() {
   initPins();
   // Set GPIB control bus to controller idle mode
   setGpibControls(CINI);  // Controller initialise state
+  clearAddrCache();
+  setTerminator();
   // Initialise GPIB data lines (sets to INPUT_PULLUP)
-  readGpibDbus();
+  readyGpibDbus();
   // Assert IFC to signal controller in charge (CIC)
   assertIfc();
 }
@@ -92,25 +102,40 @@ void GPIB::initController() {
 
 /*****  Send a single byte GPIB command *****/
 bool GPIB::gpibSendCmd(uint8_t cmdByte) {
+  return gpibSendCmds(&cmdByte, 1);
+}
+
 
-  bool stat = false;
+/***** Send a burst of GPIB commands *****/
+/*
+ * ATN is asserted once and the n command bytes are clocked out back to
+ * back (e.g. UNL, LAD, TAD, SCG).
+ */
+bool GPIB::gpibSendCmds(const uint8_t *cmds, uint8_t n) {
 
   // Set lines for command and assert ATN
   setGpibControls(CCMS);
 
-  // Send the command
-  stat = gpibWriteByte(cmdByte);
-  if (stat && verbose()) {
-    controller.cmdstream->print(F("gpibSendCmd: failed to send command "));
-    controller.cmdstream->print(cmdByte, HEX);
-    controller.cmdstream->println(F(" to device"));
+  // Send the commands
+  for (uint8_t i = 0; i < n; i++) {
+    if (gpibWriteByte(cmds[i])) {
+      // Don't know who got addressed
+      clearAddrCache();
+      if (verbose()) {
+        msgStream()->print(F("gpibSendCmd: failed to send command "));
+        msgStream()->print(cmds[i], HEX);
+        msgStream()->println(F(" to device"));
+      }
+      return ERR;
+    }
+    trackCmd(cmds[i]);
   }
 
   // Return to controller idle state
   //  setGpibControls(CIDS);
   // NOTE: this breaks serial poll
 
-  return stat ? ERR : OK;
+  return OK;
 }
 
 
@@ -127,30 +152,42 @@ void GPIB::gpibSendStatus() {
 }
 
 
-bool GPIB::findListeners(uint8_t addrs[31]) {
+/***** Find the listeners on the bus *****/
+/*
+ * Each primary address is probed with one command burst (UNL, LAD) after
+ * which ATN is unasserted: a listener holds NDAC asserted (see lstn_tmo_us).
+ * Addresses without a listener are then probed for extended (secondary)
+ * listeners: LAD followed by a range of SCG bytes addresses every listener
+ * of the range at once, so an unused primary address costs one more probe
+ * and a used one is narrowed down by halving the range.
+ * Entries are set to pa | (SCG << 8) (no secondary: SCG = 0), the unused
+ * ones to 0xFFFF.
+ */
+bool GPIB::findListeners(uint16_t *addrs, uint8_t size) {
   if (config.cmode == 1) {
     controller.cmdstream->println(F("FINDLSTN only available in Controller mode"));
     return ERR;
   }
-  uint8_t addr;
-  uint8_t i;
+  uint8_t n = 0;
+  int8_t r;
 
-  for(i=0; i<31; i++)
-    addrs[i] = 255;
+  for (uint8_t i=0; i<size; i++)
+    addrs[i] = 0xFFFF;
 
-  for(addr=0, i=0; addr<31; addr++) {
-    if (addr == config.caddr) continue;
+  // We are the talker for the whole scan
+  if (gpibSendCmd(GC_TAD + config.caddr)) return ERR;
 
-    if (gpibSendCmd(GC_UNL)) return ERR;
-    if (gpibSendCmd(GC_TAD + config.caddr)) return ERR;
-    if (gpibSendCmd(GC_LAD + addr)) return ERR;
-    setGpibControls(CTAS);  // unassert ATN
-    if (!Wait_on_pin_state(LOW, NDAC, config.rtmo)) {  // 488.2 specs suggests a timeout of minimum 1.5ms
+  for (uint8_t pa=0; pa<31; pa++) {
+    if (pa == config.caddr) continue;
+
+    r = probeListener(pa, 0, 0);
+    if (r < 0) return ERR;
+    if (r > 0) {
       // found a listener
-      addrs[i] = addr;
-      i++;
+      if (n < size) addrs[n++] = pa;
     } else {
-      // TODO search for secondary addresses
+      // search for secondary addresses
+      if (findSecondary(pa, 0, 31, false, addrs, size, n)) return ERR;
     }
   }
   if (gpibSendCmd(GC_UNL)) return ERR;
@@ -158,23 +195,158 @@ bool GPIB::findListeners(uint8_t addrs[31]) {
 }
 
 
+/***** Probe for a listener at pa (with secondary addresses sa to sa+cnt-1) *****/
+/*
+ * Returns 1 if a listener holds NDAC, 0 if none, -1 on a bus error.
+ */
+int8_t GPIB::probeListener(uint8_t pa, uint8_t sa, uint8_t cnt) {
+  uint8_t cmds[33];
+  uint8_t n = 0;
+
+  cmds[n++] = GC_UNL;
+  cmds[n++] = GC_LAD + pa;
+  for (uint8_t i=0; i<cnt; i++)
+    cmds[n++] = GC_SCG + sa + i;
+
+  if (gpibSendCmds(cmds, n)) return -1;
+  setGpibControls(CTAS);  // unassert ATN
+  return Wait_on_pin_us(LOW, NDAC, config.ltmo) ? 0 : 1;
+}
+
+
+/***** Find the secondary listeners of pa among sa to sa+cnt-1 *****/
+/*
+ * found: a listener is already known to be in the range (no probe needed)
+ */
+bool GPIB::findSecondary(uint8_t pa, uint8_t sa, uint8_t cnt, bool found,
+                         uint16_t *addrs, uint8_t size, uint8_t &n) {
+  if (!found) {
+    int8_t r = probeListener(pa, sa, cnt);
+    if (r < 0) return ERR;
+    if (r == 0) return OK;
+  }
+  if (cnt == 1) {
+    if (n < size) addrs[n++] = pa | ((uint16_t)(GC_SCG + sa) << 8);
+    return OK;
+  }
+
+  uint8_t half = cnt / 2;
+  uint8_t before = n;
+  if (findSecondary(pa, sa, half, false, addrs, size, n)) return ERR;
+  // Nothing in the lower half: the listener is in the upper half
+  return findSecondary(pa, sa + half, cnt - half, (n == before), addrs, size, n);
+}
+
+
+/***** Serial poll a list of devices *****/
+/*
+ * SPE is sent once, then each device is in turn addressed to talk (with
+ * the secondary address sa, if not 0) and its status byte collected into
+ * stb[] (-1: no response). SPD, UNT and UNL end the poll.
+ * rqsStop: stop at the first status byte with RQS set.
+ * n: number of addresses, set to the number of devices polled.
+ */
+bool GPIB::serialPoll(const uint8_t *addrs, uint8_t &n, uint8_t sa, int16_t *stb, bool rqsStop) {
+  // Controller addresses itself as listener and enables serial poll
+  const uint8_t spe[3] = { GC_UNL, (uint8_t)(GC_LAD + config.caddr), GC_SPE };
+  const uint8_t spd[3] = { GC_SPD, GC_UNT, GC_UNL };
+  uint8_t tad[2];
+  uint8_t db;
+  bool eoi;
+  uint8_t i;
+
+  if (gpibSendCmds(spe, 3)) return ERR;
+
+  for (i = 0; i < n; i++) {
+    stb[i] = -1;
+    // Don't need to poll own address
+    if (addrs[i] == config.caddr) continue;
+
+    // Address the device to talk
+    tad[0] = GC_TAD + addrs[i];
+    tad[1] = sa;
+    if (gpibSendCmds(tad, sa ? 2 : 1)) return ERR;
+
+    // Read the status byte (ATN unasserted)
+    setGpibControls(CLAS);
+    if (gpibReadByte(&db, &eoi) == 0) {
+      stb[i] = db;
+      if (rqsStop && (db & 0x40)) {
+        i++;
+        break;
+      }
+    }
+  }
+  n = i;
+
+  if (gpibSendCmds(spd, 3)) return ERR;
+
+  // Set GPIB control to controller idle state
+  setGpibControls(CIDS);
+  return OK;
+}
+
+
+/***** Conduct a parallel poll *****/
+/*
+ * Returns the state of the DIO lines (bit 0 = DIO1) while ATN and EOI
+ * are asserted, i.e. the parallel poll response of the configured devices.
+ */
+uint8_t GPIB::parallelPoll() {
+  uint8_t pb;
+
+  // Start in controller idle state
+  setGpibControls(CIDS);
+  // Devices drive the DIO lines: release them
+  readyGpibDbus();
+  delayMicroseconds(20);
+  // Assert ATN and EOI
+  setGpibState(0b00000000, 0b10010000, 0);
+  delayMicroseconds(20);
+  // Read data byte from GPIB bus without handshake
+  pb = readGpibDbus();
+  // Return to controller idle state (ATN and EOI unasserted)
+  setGpibControls(CIDS);
+
+  return pb;
+}
+
+
 /***** Send a series of characters as data to the GPIB bus *****/
 void GPIB::gpibSendData(char *data, uint8_t dsize, bool bufferFull) {
 
   bool err = false;
 
+  // Count data bus direction changes for this transfer
+  resetDbusDirChanges();
+
   // Controler can unlisten bus and address devices
+  if (txAddress(bufferFull)) return;
+
+  // Write the data
+  err = gpibWriteData(data, dsize, bufferFull);
+
+  txRelease(err);
+}
+
+
+/***** Address the device to listen for a send *****/
+/*
+ * Returns true if the device could not be addressed.
+ */
+bool GPIB::txAddress(bool bufferFull) {
+
   if (config.cmode == 2) {
 
     if (deviceAddressing) {
       // Address device to listen
-      if (addrDev(config.paddr, 0)) {
+      if (addrDev(config.paddr, config.saddr, 0)) {
         if (verbose()) {
-          controller.cmdstream->print(F("gpibSendData: failed to address device "));
-          controller.cmdstream->print(config.paddr);
-          controller.cmdstream->println(F(" to listen"));
+          msgStream()->print(F("gpibSendData: failed to address device "));
+          msgStream()->print(config.paddr);
+          msgStream()->println(F(" to listen"));
         }
-        return;
+        return true;
       }
     }
 
@@ -184,73 +356,21 @@ void GPIB::gpibSendData(char *data, uint8_t dsize, bool bufferFull) {
     dbSerial->println(F("Device addressed."));
 #endif
 
-    // Set control lines to write data (ATN unasserted)
-    setGpibControls(CTAS);
-
-  } else {
-    setGpibControls(DTAS);
   }
-#ifdef DEBUG3
-  dbSerial->println(F("Set write data mode."));
-  dbSerial->print(F("Send->"));
-#endif
-
-  // Write the data string
-  for (int i = 0; i < dsize; i++) {
-    // If EOI asserting is on
-    if (config.eoi) {
-      // Send all characters
-      err = gpibWriteByte(data[i]);
-    } else {
-      // Otherwise ignore non-escaped CR, LF and ESC
-      if ((data[i] != CR) || (data[i] != LF) || (data[i] != ESC)) err = gpibWriteByte(data[i]);
-    }
-#ifdef DEBUG3
-    dbSerial->print(data[i]);
-#endif
-    if (err) break;
-  }
-
-#ifdef DEBUG3
-  dbSerial->println("<-End.");
-#endif
+  return false;
+}
 
-  if (!err) {
-    // Write terminators according to EOS setting
-    // Do we need to write a CR?
-    if ((config.eos & 0x2) == 0) {
-      gpibWriteByte(CR);
-#ifdef DEBUG3
-      dbSerial->println(F("Appended CR"));
-#endif
-    }
-    // Do we need to write an LF?
-    if ((config.eos & 0x1) == 0) {
-      gpibWriteByte(LF);
-#ifdef DEBUG3
-      dbSerial->println(F("Appended LF"));
-#endif
-    }
-  }
 
-  // If EOI enabled and no more data to follow then assert EOI
-  if (config.eoi && !bufferFull) {
-    setGpibState(0b00000000, 0b00010000, 0);
-    //    setGpibState(0b00010000, 0b00000000, 0b00010000);
-    delayMicroseconds(40);
-    setGpibState(0b00010000, 0b00010000, 0);
-    //    setGpibState(0b00010000, 0b00010000, 0b00010000);
-#ifdef DEBUG3
-    dbSerial->println(F("Asserted EOI"));
-#endif
-  }
+/***** Return the bus to idle at the end of a send *****/
+void GPIB::txRelease(bool err) {
 
   if (config.cmode == 2) {   // Controller mode
+    if (err) clearAddrCache();
     if (!err) {
       if (deviceAddressing) {
         // Untalk controller and unlisten bus
         if (uaddrDev()) {
-          if (verbose()) controller.cmdstream->println(F("gpibSendData: Failed to unlisten bus"));
+          if (verbose()) msgStream()->println(F("gpibSendData: Failed to unlisten bus"));
         }
 
 #ifdef DEBUG3
@@ -267,6 +387,11 @@ void GPIB::gpibSendData(char *data, uint8_t dsize, bool bufferFull) {
     setGpibControls(DIDS);
   }
 
+  if (verbose()) {
+    msgStream()->print(F("Bus direction changes: "));
+    msgStream()->println(getDbusDirChanges());
+  }
+
 #ifdef DEBUG3
     dbSerial->println(F("<- End of send."));
 #endif
@@ -274,40 +399,226 @@ void GPIB::gpibSendData(char *data, uint8_t dsize, bool bufferFull) {
 }
 
 
+/***** EOS characters to append to the data (returns their number) *****/
+uint8_t GPIB::getEos(uint8_t *eos) {
+  uint8_t neos = 0;
+  if ((config.eos & 0x2) == 0) eos[neos++] = CR;
+  if ((config.eos & 0x1) == 0) eos[neos++] = LF;
+  return neos;
+}
+
+
+/***** Write the data bytes of a send *****/
+/*
+ * The device must already be addressed to listen (controller mode) or we
+ * must have been addressed to talk (device mode). Writes the data followed
+ * by the EOS characters and signals EOI when enabled.
+ * Returns true on error.
+ */
+bool GPIB::gpibWriteData(char *data, uint8_t dsize, bool bufferFull) {
+
+  bool err = false;
+
+  if (config.cmode == 2) {
+    // Set control lines to write data (ATN unasserted)
+    setGpibControls(CTAS);
+  } else {
+    setGpibControls(DTAS);
+  }
+#ifdef DEBUG3
+  dbSerial->println(F("Set write data mode."));
+  dbSerial->print(F("Send->"));
+  for (int i = 0; i < dsize; i++) dbSerial->print(data[i]);
+  dbSerial->println("<-End.");
+#endif
+
+  // EOS characters to append
+  uint8_t eos[2];
+  uint8_t neos = getEos(eos);
+
+  // If EOI enabled and no more data to follow then assert EOI with the last byte
+  bool eoi = config.eoi && !bufferFull;
+
+  // Write the data string, then the terminators according to EOS setting
+  err = gpibWriteBytes((uint8_t *)data, dsize, eoi && (neos == 0));
+  if (!err) err = gpibWriteBytes(eos, neos, eoi);
+
+#ifdef DEBUG3
+  if (eoi && !err) dbSerial->println(F("Asserted EOI"));
+#endif
+
+  return err;
+}
+
+
 /***** Receive data from the GPIB bus ****/
+bool GPIB::gpibReceiveData() {
+
+  uint8_t r = 0;
+
+  // Count data bus direction changes for this transfer
+  resetDbusDirChanges();
+
+  // Set up for reading in Controller mode
+  rxAddress();
+
+  // Read the data
+  r = gpibReadData();
+
+  // Return controller to idle state
+  rxRelease(r);
+
+  if (r > 0) return ERR;
+
+  return OK;
+}
+
+
+/***** Address the device to talk for a receive *****/
 /*
+ * Returns true if the device could not be addressed.
+ */
+bool GPIB::rxAddress() {
+  if (config.cmode == 2) {   // Controler mode
+    // Address device to talk
+    if (addrDev(config.paddr, config.saddr, 1)) {
+      if (verbose()) {
+        msgStream()->print(F("Failed to address the device"));
+        msgStream()->print(config.paddr);
+        msgStream()->println(F(" to talk"));
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/***** Return the bus to idle at the end of a receive *****/
+void GPIB::rxRelease(uint8_t r) {
+
+  if (config.cmode == 2) {
+
+    // The talker may not have completed: unaddress it
+    if (r > 0) clearAddrCache();
+
+    // Untalk bus and unlisten controller
+    if (uaddrDev()) {
+      if (verbose()) msgStream()->print(F("gpibSendData: Failed to untalk bus"));
+    }
+
+    // Set controller back to idle state
+    setGpibControls(CIDS);
+
+  } else {
+    // Set device back to idle state
+    setGpibControls(DIDS);
+  }
+
+  if (verbose()) {
+    msgStream()->print(F("Bus direction changes: "));
+    msgStream()->println(getDbusDirChanges());
+  }
+
+#ifdef DEBUG7
+    dbSerial->println(F("<- End listen."));
+#endif
+
+  // Reset flags
+//  isReading = false;
+  if (tranBrk > 0) tranBrk = 0;
+}
+
+
+/***** Read the data bytes of a receive *****/
+/*
+ * The device must already be addressed to talk (controller mode).
+ * Returns 0 on success or the gpibReadByte() error code.
  * Readbreak:
  * 5 - EOI detected
  * 7 - command received via serial
  */
-bool GPIB::gpibReceiveData() {
+uint8_t GPIB::gpibReadData() {
 
-  uint8_t r = 0; //, db;
-  uint8_t bytes[3] = {0};
-  uint8_t eor = config.eor&7;
-  int x = 0;
-  bool eoiStatus;
+  uint8_t r = 0;
+  uint8_t db = 0;
   bool eoiDetected = false;
 
+  // Wait for instrument ready
+  if (config.cmode == 2) Wait_on_pin_state(HIGH, NRFD, config.rtmo);
+
+  rxBegin();
+
+  // Perform read of data (r=0: data read OK; r>0: GPIB read error);
+  while (r == 0) {
+
+    // Tranbreak > 0 indicates break condition, or ATN asserted
+    // (a counted read stops only on error)
+    if ((rCnt == 0) && ((tranBrk > 0) || isAtnAsserted())) break;
+
+    // Read the next character on the GPIB bus
+    r = gpibReadByte(&db, &eoiDetected);
+
+    // When reading with amode=3 or EOI check serial input and break loop if neccessary
+    if ((rCnt == 0) && ((config.amode==3) || rEoi))
+	  // XXX find a better solution
+	  if (controller.serialIn_h() > 0) {
+		// Line terminator detected (loop breaks on command being detected or data buffer full)
+		controller.aRead = false;  // Stop auto read
+		break;
+	  }
+
+    // No byte received (timeout waiting for the talker or ATN change)
+    if ((r == 1) || (r == 3)) break;
+
+#ifdef DEBUG7
+    if (eoiDetected) dbSerial->println(F("\r\nEOI detected."));
+#endif
+
+    // If break condition ocurred or ATN asserted then break here
+    if ((rCnt == 0) && isAtnAsserted()) break;
+
+    // Output the character, stop at the end of the data
+    if (rxData(db, eoiDetected)) break;
+  }
+
+  rxEnd(r);
+
+  return r;
+}
+
+
+/***** Set the bus and the read state up for reading data *****/
+void GPIB::rxBegin() {
+
   // Reset transmission break flag
   tranBrk = 0;
 
+  rxCount = 0;
+  rxEoi = false;
+  blkDigits = -1;
+  blkLen = 0;
+  blkCnt = 0;
+  blkStart = true;
+
+  // Received data goes to the stream the read was requested from (the
+  // GPIB task was given it by xfrSend()/xfrReceive())
+  if (!inTask()) oStream = controller.cmdstream;
+
   // Set status of EOI detection
-  eoiStatus = rEoi; // Save status of rEoi flag
+  rEoiSaved = rEoi; // Save status of rEoi flag
   if (config.eor==7) rEoi = true;    // Using EOI as terminator
 
+  // Stop on specified <char> if appended to ++read command
+  rTerm = &eorTerm;
+  if (rEbt) {
+    ebtTerm.set(&eByte, 1);
+    rTerm = &ebtTerm;
+  }
+  rTerm->reset();
+
   // Set up for reading in Controller mode
   if (config.cmode == 2) {   // Controler mode
-    // Address device to talk
-    if (addrDev(config.paddr, 1)) {
-      if (verbose()) {
-        controller.cmdstream->print(F("Failed to address the device"));
-        controller.cmdstream->print(config.paddr);
-        controller.cmdstream->println(F(" to talk"));
-      }
-    }
-    // Wait for instrument ready
-    Wait_on_pin_state(HIGH, NRFD, config.rtmo);
     // Set GPIB control lines to controller read mode
     setGpibControls(CLAS);
 
@@ -329,116 +640,583 @@ bool GPIB::gpibReceiveData() {
     dbSerial->println(isAtnAsserted() ? 1 : 0);
 #endif
 
-  // Ready the data bus
-  readyGpibDbus();
+  // Ready the data bus
+  readyGpibDbus();
+}
+
+
+/***** Output a received byte *****/
+/*
+ * Returns true when the read is complete: byte count reached, end of a
+ * definite length block (++read block), EOI or terminator sequence.
+ */
+bool GPIB::rxData(uint8_t db, bool eoi) {
+
+#ifdef DEBUG7
+  dbSerial->print(db, HEX), dbSerial->print(' ');
+#else
+  // Stage the character for output to the serial port
+  outByte(db);
+#endif
+
+  // Byte counter
+  rxCount++;
+  rNext = true;
+  rxEoi = eoi;
+
+  // Counted read: exactly rCnt bytes
+  if (rCnt > 0) return (rxCount >= rCnt);
+
+  // Definite length block payload: counted, no terminator scanning
+  if (blkCnt > 0) {
+    blkCnt--;
+    if (blkCnt == 0) {
+      // End of block: resume normal termination
+      rTerm->reset();
+      if (rBlk) return true;
+    }
+    return (rEoi && eoi);
+  }
+
+  // Look for a definite length block header: #<n><len>, at the start of
+  // the response or of a data element (after a ',' or ';' separator)
+  if (blkDigits < 0) {
+    if ((db == '#') && blkStart) blkDigits = 0;
+    blkStart = ((db == ',') || (db == ';'));
+  } else if (blkDigits == 0) {
+    // Number of length digits (#0 is an indefinite length block)
+    blkDigits = ((db > '0') && (db <= '9')) ? (db - '0') : -1;
+    blkLen = 0;
+  } else if ((db >= '0') && (db <= '9')) {
+    blkLen = (blkLen * 10) + (db - '0');
+    if (--blkDigits == 0) {
+      blkDigits = -1;
+      blkCnt = blkLen;
+      if ((blkLen == 0) && rBlk) return true;
+    }
+  } else {
+    blkDigits = -1;
+  }
+
+  // EOI detection enabled and EOI detected?
+  if (rEoi) return eoi;
+
+  // Has a termination sequence been found ?
+  return rTerm->match(db);
+}
+
+
+/***** End of the data bytes of a receive *****/
+void GPIB::rxEnd(uint8_t r) {
+
+  // Terminator, EOI, timeout or break: send what is left
+  outFlush();
+
+#ifdef DEBUG7
+  dbSerial->println();
+  dbSerial->println(F("After loop flags:"));
+  dbSerial->print(F("ATN: "));
+  dbSerial->println(isAtnAsserted());
+  dbSerial->print(F("TMO:  "));
+  dbSerial->println(r);
+#endif
+
+  // End of data - if verbose, report how many bytes read
+  if (verbose()) {
+    msgStream()->print(F("Bytes read: "));
+    msgStream()->println(rxCount);
+  }
+
+  // Detected that EOI has been asserted
+  if (rxEoi) {
+    if (verbose()) msgStream()->println(F("EOI detected!"));
+    // If eot_enabled then add EOT character
+    if (config.eot_en && !capBuf) {
+      outByte(config.eot_ch);
+      outFlush();
+    }
+  }
+
+  // Return rEoi to previous state
+  rEoi = rEoiSaved;
+  rNext = false;
+
+  // Verbose timeout error
+  if (r > 0) {
+    if (verbose() && r == 1) msgStream()->println(F("Timeout waiting for sender!"));
+    if (verbose() && r == 2) msgStream()->println(F("Timeout waiting for transfer to complete!"));
+  }
+}
+
+
+/***** Start a non-blocking send *****/
+/*
+ * data (the parse buffer) is written to the device, followed by the EOS
+ * characters, then the response is read if read is set. The handshake
+ * is advanced by xfrStep() without waiting for the device: loop() keeps
+ * serving the streams meanwhile. The parse buffer is released with
+ * Controller::flushPbuf() once the data has been written, or at once
+ * when the GPIB task writes a copy of it.
+ * Controller mode only.
+ */
+void GPIB::xfrSend(char *data, uint8_t dsize, bool bufferFull, bool read) {
+#ifdef USE_GPIB_TASK
+  // The task only works on its own copy of the request
+  oStream = controller.cmdstream;
+  memcpy(xReqBuf, data, dsize);
+  controller.flushPbuf();
+  xReqSize = dsize;
+  xReqFull = bufferFull;
+  xRead = read;
+  xState = XS_QUEUED;
+  xReq = 1;
+  xTaskNotifyGive(xTask);
+#else
+  txStart(data, dsize, bufferFull, read);
+#endif
+}
+
+
+/***** Start a non-blocking receive (controller mode) *****/
+void GPIB::xfrReceive() {
+#ifdef USE_GPIB_TASK
+  oStream = controller.cmdstream;
+  xState = XS_QUEUED;
+  xReq = 2;
+  xTaskNotifyGive(xTask);
+#else
+  rxStart();
+#endif
+}
+
+
+/***** Start the write of a non-blocking send *****/
+void GPIB::txStart(char *data, uint8_t dsize, bool bufferFull, bool read) {
+
+  // Count data bus direction changes for this transfer
+  resetDbusDirChanges();
+
+  xRead = read;
+  if (txAddress(bufferFull)) {
+#ifndef USE_GPIB_TASK
+    controller.flushPbuf();
+#endif
+    if (xRead) rxStart(); else xfrDone();
+    return;
+  }
+
+  // Set control lines to write data (ATN unasserted)
+  setGpibControls(CTAS);
+
+  xData = (const uint8_t *)data;
+  xLen = dsize;
+  xNeos = getEos(xEos);
+  xEoi = config.eoi && !bufferFull;
+  xPos = 0;
+
+  // Wait for NDAC to go LOW (indicating that devices are at attention)
+  xfrTimer(config.ltmo, true);
+  xState = XS_TX_LSTN;
+  if (xLen + xNeos == 0) txStep();
+}
+
+
+/***** Start the read of a non-blocking receive *****/
+void GPIB::rxStart() {
+
+  // Count data bus direction changes for this transfer
+  resetDbusDirChanges();
+
+  rxAddress();
+
+  // Wait for instrument ready
+  xfrTimer(config.rtmo, false);
+  xState = XS_RX_NRFD;
+}
+
+
+/***** Advance the non-blocking transfer *****/
+/*
+ * Handshake steps are taken as long as the bus is ready for them, for
+ * up to XFR_SLICE_US. Returns at once when the device keeps us waiting:
+ * the wait resumes on the next call.
+ */
+void GPIB::xfrStep() {
+  uint32_t ticks = hsUsToTicks(XFR_SLICE_US);
+  uint32_t start = getHsTicks();
+  uint8_t state;
+
+  do {
+    state = xState;
+    if ((state == XS_IDLE) || (state >= XS_DONE)) return;
+    if (state < XS_RX_NRFD) {
+      txStep();
+    } else {
+      rxStep();
+    }
+  } while ((xState != state) && ((getHsTicks() - start) < ticks));
+}
+
+
+/***** Serve the non-blocking transfer from loop() *****/
+/*
+ * Advances the transfer (or, when it runs in the GPIB task, outputs the
+ * data received so far), then ends it once complete.
+ */
+void GPIB::xfrService() {
+#ifdef USE_GPIB_TASK
+  outDrain();
+#else
+  xfrStep();
+#endif
+  if (xState != XS_DONE) return;
+#ifdef USE_GPIB_TASK
+  // Data queued just before the end
+  outDrain();
+#endif
+  xState = XS_IDLE;
+  if (xPrompt) {
+    xPrompt = false;
+    controller.showPrompt();
+  }
+}
+
+
+/***** Complete the non-blocking transfer *****/
+void GPIB::xfrWait() {
+  while (xfrBusy()) {
+    xfrService();
+#ifdef USE_GPIB_TASK
+    // Let the idle task of the core run while the GPIB task works
+    delay(1);
+#endif
+  }
+}
+
+
+/***** Can new input break the read in progress? *****/
+/*
+ * As with gpibReadData(), only when reading with amode=3 or EOI.
+ */
+bool GPIB::xfrBreakable() {
+  return ((xState == XS_RX_DAV) || (xState == XS_RX_DAVH)) && ((config.amode == 3) || rEoi);
+}
+
+
+/***** Time the current step: tmo in microseconds (us) or milliseconds *****/
+void GPIB::xfrTimer(uint32_t tmo, bool us) {
+  xUs = us;
+  xTmo = us ? hsUsToTicks(tmo) : tmo;
+  xStart = us ? getHsTicks() : millis();
+}
+
+
+/***** Has the current step timed out? *****/
+bool GPIB::xfrExpired() {
+  return ((xUs ? getHsTicks() : millis()) - xStart) >= xTmo;
+}
+
+
+/***** Write handshake step (see gpibWriteBytes()) *****/
+void GPIB::txStep() {
+
+  uint16_t n = xLen + xNeos;
+  bool err = false;
+  // Timer read before the pins: a pause in between cannot fake a timeout
+  bool expired = xfrExpired();
+
+  switch (xState) {
+
+    case XS_TX_LSTN:
+      if (n == 0) break;
+      if (getGpibPin(NDAC) == LOW) {
+        xfrTimer(config.rtmo, false);
+        xState = XS_TX_NRFD;
+        return;
+      }
+      if (!expired) return;
+      if (verbose()) msgStream()->println(
+	    F("gpibWriteBytes: timeout waiting for receiver attention [NDAC asserted]"));
+      err = true;
+      break;
+
+    case XS_TX_NRFD:
+      if (getGpibPin(NRFD) == HIGH) {
+        // Place data on the bus, with EOI on the last byte
+        setGpibDbus((xPos < xLen) ? xData[xPos] : xEos[xPos - xLen]);
+        if (xEoi && (xPos == n - 1)) setGpibState(0b00000000, 0b00010000, 0);
+        // Data settling time then assert DAV (data is valid - ready to collect)
+        delayMicroseconds(GPIB_T1);
+        setGpibState(0b00000000, 0b00001000, 0);
+        xfrTimer(config.btmo, false);
+        xState = XS_TX_NDAC;
+        return;
+      }
+      if (!expired) return;
+      if (verbose()) msgStream()->println(
+	    F("gpibWriteBytes: timeout waiting for receiver ready - [NRFD unasserted]"));
+      err = true;
+      break;
+
+    case XS_TX_NDAC:
+      if (getGpibPin(NDAC) == HIGH) {
+        // Unassert DAV
+        setGpibState(0b00001000, 0b00001000, 0);
+        // Optional GPIB bus DELAY
+        if (config.tmbus) delayMicroseconds(config.tmbus);
+        if (++xPos < n) {
+          xfrTimer(config.btmo, false);
+          xState = XS_TX_NRFD;
+          return;
+        }
+        break;
+      }
+      if (!expired) return;
+      if (verbose()) msgStream()->println(
+	    F("gpibWriteBytes: timeout waiting for data accepted signal - [NDAC unasserted]"));
+      err = true;
+      break;
+  }
+
+  // Data written or error: unassert DAV and EOI, reset the data bus
+  setGpibState(0b00011000, 0b00011000, 0);
+  setGpibDbus(0);
+#ifndef USE_GPIB_TASK
+  controller.flushPbuf();
+#endif
+
+  txRelease(err);
+
+  if (xRead) {
+    rxStart();
+  } else {
+    xfrDone();
+  }
+}
+
 
-  // Perform read of data (r=0: data read OK; r>0: GPIB read error);
-  while (r == 0) {
+/***** Read handshake step (see gpibReadByte()) *****/
+void GPIB::rxStep() {
+  // Timer read before the pins (see txStep())
+  bool expired = xfrExpired();
 
-    // Tranbreak > 0 indicates break condition
-    if (tranBrk > 0) break;
+  switch (xState) {
 
-    // ATN asserted
-    if (isAtnAsserted()) break;
+    case XS_RX_NRFD:
+      // Wait for instrument ready (the read starts anyway on timeout)
+      if ((getGpibPin(NRFD) == HIGH) || expired) {
+        rxBegin();
+        // Unassert NRFD (we are ready for more data)
+        setGpibState(0b00000100, 0b00000100, 0);
+        xfrTimer(config.rtmo, false);
+        xState = XS_RX_DAV;
+      }
+      break;
 
-    // Read the next character on the GPIB bus
-    r = gpibReadByte(&bytes[0], &eoiDetected);
+    case XS_RX_DAV:
+      // Break condition or ATN asserted (a counted read stops only on error)
+      if ((rCnt == 0) && ((tranBrk > 0) || isAtnAsserted())) {
+        setGpibState(0b00000000, 0b00000100, 0);
+        rxFinish(0);
+      } else if (getGpibPin(DAV) == LOW) {
+        // Assert NRFD (NOT ready - busy reading data)
+        setGpibState(0b00000000, 0b00000100, 0);
+        // Check for EOI signal, read from DIO
+        xByteEoi = (rEoi && (getGpibPin(EOI) == LOW));
+        xByte = readGpibDbus();
+        // Unassert NDAC signalling data accepted
+        setGpibState(0b00000010, 0b00000010, 0);
+        xfrTimer(config.btmo, false);
+        xState = XS_RX_DAVH;
+      } else if (expired) {
+        if (verbose()) msgStream()->println(F("gpibReadByte: timeout waiting for DAV to go LOW"));
+        setGpibState(0b00000000, 0b00000100, 0);
+        rxFinish(1);
+      } else if (oLen && ((millis() - oTime) >= config.oflush)) {
+        // Talker not ready: send staged output past the flush deadline
+        outFlush();
+      }
+      break;
 
-    // When reading with amode=3 or EOI check serial input and break loop if neccessary
-    if ((config.amode==3) || rEoi)
-	  // XXX find a better solution
-	  if (controller.serialIn_h() > 0) {
-		// Line terminator detected (loop breaks on command being detected or data buffer full)
-		controller.aRead = false;  // Stop auto read
-		break;
-	  }
+    case XS_RX_DAVH:
+      if (getGpibPin(DAV) == HIGH) {
+        // Re-assert NDAC - handshake complete, ready to accept data again
+        setGpibState(0b00000000, 0b00000010, 0);
+        // GPIB bus DELAY
+        if (config.tmbus) delayMicroseconds(config.tmbus);
+        if (((rCnt == 0) && isAtnAsserted()) || rxData(xByte, xByteEoi)) {
+          rxFinish(0);
+        } else {
+          // Unassert NRFD (we are ready for more data)
+          setGpibState(0b00000100, 0b00000100, 0);
+          xfrTimer(config.btmo, false);
+          xState = XS_RX_DAV;
+        }
+      } else if (expired) {
+        if (verbose()) msgStream()->println(F("gpibReadByte: timeout waiting DAV to go HIGH"));
+        rxData(xByte, xByteEoi);
+        rxFinish(2);
+      }
+      break;
+  }
+}
 
-#ifdef DEBUG7
-    if (eoiDetected) dbSerial->println(F("\r\nEOI detected."));
+
+/***** End of a non-blocking receive *****/
+void GPIB::rxFinish(uint8_t r) {
+  rxEnd(r);
+  rxRelease(r);
+  // A byte count only applies to a single read
+  if (config.amode != 3) rCnt = 0;
+  xfrDone();
+}
+
+
+/***** End of a non-blocking transfer (see xfrService()) *****/
+void GPIB::xfrDone() {
+  xData = NULL;
+#ifdef USE_GPIB_TASK
+  // Received data queued before the end is seen by loop()
+  __sync_synchronize();
 #endif
+  xState = XS_DONE;
+}
 
-    // If break condition ocurred or ATN asserted then break here
-    if (isAtnAsserted()) break;
 
-#ifdef DEBUG7
-    dbSerial->print(bytes[0], HEX), dbSerial->print(' ');
-#else
-    // Output the character to the serial port
-    controller.cmdstream->print((char)bytes[0]);
+#ifdef USE_GPIB_TASK
+#if ARDUINO_RUNNING_CORE == GPIB_TASK_CORE
+#error "USE_GPIB_TASK: loop() must run on the other core (-D ARDUINO_RUNNING_CORE=0)"
 #endif
 
-    // Byte counter
-    x++;
+/***** Start the GPIB task *****/
+/*
+ * The task runs the non-blocking transfers on GPIB_TASK_CORE (core 1),
+ * loop() and the WiFi tasks on core 0. It only shares data with loop()
+ * through the request (xReq*, see xfrSend()), the transfer state and the
+ * ring of received data.
+ */
+void GPIB::startTask() {
+  xTaskCreatePinnedToCore(taskMain, "gpib", 4096, this, GPIB_TASK_PRIO, &xTask, GPIB_TASK_CORE);
+}
+
 
-    // EOI detection enabled and EOI detected?
-    if (rEoi) {
-      if (eoiDetected) break;
-    }else{
-      // Has a termination sequence been found ?
-      if (isTerminatorDetected(bytes, eor)) break;
+/***** GPIB task *****/
+void GPIB::taskMain(void *arg) {
+  GPIB *g = (GPIB *)arg;
+  uint8_t state;
+  unsigned long wait;
+  unsigned long run;
+
+  for (;;) {
+    // Wait for a transfer request from loop()
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (g->xReq == 1) {
+      g->txStart(g->xReqBuf, g->xReqSize, g->xReqFull, g->xRead);
+    } else if (g->xReq == 2) {
+      g->rxStart();
+    }
+    g->xReq = 0;
+
+    // Run it to the end, yielding after each step. The task sleeps for
+    // a tick when the device keeps it waiting for more than a slice, and
+    // at least every XFR_TASK_RUN_US, so that the idle task of the core
+    // gets to run.
+    wait = run = micros();
+    while ((g->xState != XS_IDLE) && (g->xState < XS_DONE)) {
+      state = g->xState;
+      g->xfrStep();
+      if (g->xState != state) wait = micros();
+      if (((micros() - wait) >= XFR_SLICE_US) || ((micros() - run) >= XFR_TASK_RUN_US)) {
+        vTaskDelay(1);
+        wait = run = micros();
+      } else {
+        taskYIELD();
+      }
     }
+  }
+}
 
-    // Stop on timeout
-    if (r > 0) break;
 
-    // Shift last three bytes in memory
-    bytes[2] = bytes[1];
-    bytes[1] = bytes[0];
+/***** Queue received data for loop() *****/
+void GPIB::outQueue(const uint8_t *buf, uint8_t n) {
+  for (uint8_t i = 0; i < n; i++) {
+    // Wait for loop() to make room
+    while ((uint16_t)(oHead - oTail) >= GPIB_TASK_QSIZE) vTaskDelay(1);
+    oRing[oHead & (GPIB_TASK_QSIZE - 1)] = buf[i];
+    __sync_synchronize();
+    oHead++;
   }
+}
 
-#ifdef DEBUG7
-  dbSerial->println();
-  dbSerial->println(F("After loop flags:"));
-  dbSerial->print(F("ATN: "));
-  dbSerial->println(isAtnAsserted());
-  dbSerial->print(F("TMO:  "));
-  dbSerial->println(r);
-#endif
 
-  // End of data - if verbose, report how many bytes read
-  if (verbose()) {
-    controller.cmdstream->print(F("Bytes read: "));
-    controller.cmdstream->println(x);
+/***** Output the data queued by the task *****/
+void GPIB::outDrain() {
+  uint16_t head = oHead;
+  uint16_t i;
+  uint16_t n;
+
+  __sync_synchronize();
+  while (oTail != head) {
+    // Contiguous part of the ring
+    i = oTail & (GPIB_TASK_QSIZE - 1);
+    n = head - oTail;
+    if (n > GPIB_TASK_QSIZE - i) n = GPIB_TASK_QSIZE - i;
+    oStream->write(&oRing[i], n);
+    __sync_synchronize();
+    oTail += n;
   }
+}
+#endif
 
-  // Detected that EOI has been asserted
-  if (eoiDetected) {
-    if (verbose()) controller.cmdstream->println(F("EOI detected!"));
-    // If eot_enabled then add EOT character
-    if (config.eot_en) controller.cmdstream->print(config.eot_ch);
-  }
 
-  // Return rEoi to previous state
-  rEoi = eoiStatus;
+/***** Write a query to the device and read the response *****/
+/*
+ * The device is addressed to listen, the query is written, then the
+ * device is readdressed to talk straight from the controller talker
+ * state: the bus does not return to idle (CIDS) between the write and
+ * the read.
+ */
+bool GPIB::gpibQuery(char *data, uint8_t dsize) {
 
-  // Verbose timeout error
-  if (r > 0) {
-    if (verbose() && r == 1) controller.cmdstream->println(F("Timeout waiting for sender!"));
-    if (verbose() && r == 2) controller.cmdstream->println(F("Timeout waiting for transfer to complete!"));
-  }
+  uint8_t r = 1;
 
-  // Return controller to idle state
-  if (config.cmode == 2) {
+  // Count data bus direction changes for this transfer
+  resetDbusDirChanges();
 
-    // Untalk bus and unlisten controller
-    if (uaddrDev()) {
-      if (verbose()) controller.cmdstream->print(F("gpibSendData: Failed to untalk bus"));
+  // Address device to listen
+  if (addrDev(config.paddr, config.saddr, 0)) {
+    if (verbose()) {
+      controller.cmdstream->print(F("gpibQuery: failed to address device "));
+      controller.cmdstream->print(config.paddr);
+      controller.cmdstream->println(F(" to listen"));
     }
+  } else if (!gpibWriteData(data, dsize, false)) {
+    // Turn the bus around: device to talk, controller to listen
+    if (addrDev(config.paddr, config.saddr, 1)) {
+      if (verbose()) {
+        controller.cmdstream->print(F("gpibQuery: failed to address device "));
+        controller.cmdstream->print(config.paddr);
+        controller.cmdstream->println(F(" to talk"));
+      }
+    } else {
+      r = gpibReadData();
+    }
+  }
 
-    // Set controller back to idle state
-    setGpibControls(CIDS);
-
-  } else {
-    // Set device back to idle state
-    setGpibControls(DIDS);
+  // Untalk bus and unlisten controller
+  if (r > 0) clearAddrCache();
+  if (uaddrDev()) {
+    if (verbose()) controller.cmdstream->println(F("gpibQuery: Failed to untalk bus"));
   }
 
-#ifdef DEBUG7
-    dbSerial->println(F("<- End listen."));
-#endif
+  // Set controller back to idle state
+  setGpibControls(CIDS);
+
+  if (verbose()) {
+    controller.cmdstream->print(F("Bus direction changes: "));
+    controller.cmdstream->println(getDbusDirChanges());
+  }
 
-  // Reset flags
-//  isReading = false;
   if (tranBrk > 0) tranBrk = 0;
 
   if (r > 0) return ERR;
@@ -447,48 +1225,107 @@ bool GPIB::gpibReceiveData() {
 }
 
 
-/***** Check for terminator *****/
-bool GPIB::isTerminatorDetected(uint8_t bytes[3], uint8_t eor_sequence){
-  if (rEbt) {
-    // Stop on specified <char> if appended to ++read command
-    if (bytes[0] == eByte) return true;
-  }else{
-    // Look for specified terminator (CR+LF by default)
-    switch (eor_sequence) {
-      case 0:
-          // CR+LF terminator
-          if (bytes[0]==LF && bytes[1]==CR) return true;
-          break;
-      case 1:
-          // CR only as terminator
-          if (bytes[0]==CR) return true;
-          break;
-      case 2:
-          // LF only as terminator
-          if (bytes[0]==LF) return true;
-          break;
-      case 3:
-          // No terminator (will rely on timeout)
-          break;
-      case 4:
-          // Keithley can use LF+CR instead of CR+LF
-          if (bytes[0]==CR && bytes[1]==LF) return true;
-          break;
-      case 5:
-          // Solarton (possibly others) can also use ETX (0x03)
-          if (bytes[0]==0x03) return true;
-          break;
-      case 6:
-          // Solarton (possibly others) can also use CR+LF+ETX (0x03)
-          if (bytes[0]==0x03 && bytes[1]==LF && bytes[2]==CR) return true;
-          break;
-      default:
-          // Use CR+LF terminator by default
-          if (bytes[0]==LF && bytes[1]==CR) return true;
-          break;
-      }
+/***** Write a query and keep the response in buf instead of outputting it *****/
+/*
+ * len is set to the number of bytes received (at most size).
+ */
+bool GPIB::gpibQueryCapture(char *data, uint8_t dsize, uint8_t *buf, uint8_t size, uint8_t &len) {
+  bool err;
+
+  capBuf = buf;
+  capSize = size;
+  capLen = 0;
+  err = gpibQuery(data, dsize);
+  len = capLen;
+  capBuf = NULL;
+  return err;
+}
+
+
+/***** Stage a received byte for output *****/
+/*
+ * Bytes are written to the command stream in blocks with a single write()
+ * (one TCP segment instead of one per byte on WiFi). The buffer is sent
+ * when full, at the end of the read, and when the talker keeps us waiting
+ * past the flush deadline (see gpibReadByte()).
+ */
+void GPIB::outByte(uint8_t c) {
+  // Captured data is kept, up to the size of the buffer
+  if (capBuf) {
+    if (capLen < capSize) capBuf[capLen++] = c;
+    return;
   }
+  if (oLen == 0) oTime = millis();
+  oBuf[oLen++] = c;
+  if ((oLen >= OBUFSIZE) || (config.oflush == 0)) outFlush();
+}
+
+
+/***** Stream for the messages of the transfer routines *****/
+/*
+ * In the GPIB task the messages are queued for loop(), after the data
+ * received so far.
+ */
+Print *GPIB::msgStream() {
+#ifdef USE_GPIB_TASK
+  if (inTask()) return &taskOut;
+#endif
+  return controller.cmdstream;
+}
+
+
+/***** Running in the GPIB task? *****/
+bool GPIB::inTask() {
+#ifdef USE_GPIB_TASK
+  return (xTaskGetCurrentTaskHandle() == xTask);
+#else
   return false;
+#endif
+}
+
+
+/***** Send the staged output *****/
+void GPIB::outFlush() {
+  if (oLen == 0) return;
+#ifdef USE_GPIB_TASK
+  // Streams are written from loop() only
+  if (inTask()) {
+    outQueue(oBuf, oLen);
+    oLen = 0;
+    return;
+  }
+#endif
+  oStream->write(oBuf, oLen);
+  oLen = 0;
+}
+
+
+/***** Terminator sequences for ++eor 0-6 (length, bytes in received order) *****/
+static const uint8_t eorSeqs[7][4] = {
+  { 2, CR, LF },        // 0: CR+LF
+  { 1, CR },            // 1: CR
+  { 1, LF },            // 2: LF
+  { 0 },                // 3: None (will rely on timeout)
+  { 2, LF, CR },        // 4: LF+CR (Keithley)
+  { 1, 0x03 },          // 5: ETX (Solarton, possibly others)
+  { 3, CR, LF, 0x03 },  // 6: CR+LF+ETX (Solarton, possibly others)
+};
+
+
+/***** Build the terminator matcher for the current EOR setting *****/
+void GPIB::setTerminator() {
+  if (config.eor < 7) {
+    eorTerm.set(&eorSeqs[config.eor][1], eorSeqs[config.eor][0]);
+  } else if (config.eor == 7) {
+    // EOI is the terminator
+    eorTerm.set(NULL, 0);
+  } else if (config.eor == 8) {
+    // Custom sequence
+    eorTerm.set(config.eorseq, config.eorlen);
+  } else {
+    // Use CR+LF terminator by default
+    eorTerm.set(&eorSeqs[0][1], eorSeqs[0][0]);
+  }
 }
 
 
@@ -498,20 +1335,33 @@ bool GPIB::isTerminatorDetected(uint8_t bytes[3], uint8_t eor_sequence){
  * (- the GPIB bus must already be configured to listen )
  */
 uint8_t GPIB::gpibReadByte(uint8_t *db, bool *eoi) {
-  bool atnStat = (digitalRead(ATN) ? false : true); // Set to reverse, i.e. asserted=true; unasserted=false;
+  bool atnStat = (getGpibPin(ATN) ? false : true); // Set to reverse, i.e. asserted=true; unasserted=false;
+  unsigned long tmo = rNext ? config.btmo : config.rtmo;
+  unsigned long start;
   *eoi = false;
 
   // Unassert NRFD (we are ready for more data)
   setGpibState(0b00000100, 0b00000100, 0);
 
   // ATN asserted and just got unasserted - abort - we are not ready yet
-  if (atnStat && (digitalRead(ATN)==HIGH)) {
+  if (atnStat && (getGpibPin(ATN)==HIGH)) {
     setGpibState(0b00000000, 0b00000100, 0);
     return 3;
   }
 
+  // Talker not ready: send staged output once it is older than the flush deadline
+  if (oLen && (getGpibPin(DAV) == HIGH)) {
+    unsigned long age = millis() - oTime;
+    start = millis();
+    if ((age >= config.oflush) || Wait_on_pin_state(LOW, DAV, config.oflush - age)) outFlush();
+    // The time spent waiting and flushing is part of the timeout
+    start = millis() - start;
+    tmo = (start < tmo) ? (tmo - start) : 0;
+  }
+
   // Wait for DAV to go LOW indicating talker has finished setting data lines..
-  if (Wait_on_pin_state(LOW, DAV, config.rtmo))  {
+  if (Wait_on_pin_state(LOW, DAV, tmo))  {
+    outFlush();
     if (verbose()) controller.cmdstream->println(F("gpibReadByte: timeout waiting for DAV to go LOW"));
     setGpibState(0b00000000, 0b00000100, 0);
     // No more data for you?
@@ -522,7 +1372,7 @@ uint8_t GPIB::gpibReadByte(uint8_t *db, bool *eoi) {
   setGpibState(0b00000000, 0b00000100, 0);
 
   // Check for EOI signal
-  if (rEoi && digitalRead(EOI) == LOW) *eoi = true;
+  if (rEoi && getGpibPin(EOI) == LOW) *eoi = true;
 
   // read from DIO
   *db = readGpibDbus();
@@ -531,7 +1381,8 @@ uint8_t GPIB::gpibReadByte(uint8_t *db, bool *eoi) {
   setGpibState(0b00000010, 0b00000010, 0);
 
   // Wait for DAV to go HIGH indicating data no longer valid (i.e. transfer complete)
-  if (Wait_on_pin_state(HIGH, DAV, config.rtmo))  {
+  if (Wait_on_pin_state(HIGH, DAV, config.btmo))  {
+    outFlush();
     if (verbose()) controller.cmdstream->println(F("gpibReadByte: timeout waiting DAV to go HIGH"));
     return 2;
   }
@@ -547,6 +1398,68 @@ uint8_t GPIB::gpibReadByte(uint8_t *db, bool *eoi) {
 }
 
 
+/***** Write a block of bytes onto the GPIB bus using 3-way handshake *****/
+/*
+ * (- the GPIB bus must already be configured to talk )
+ * Each byte is presented as soon as the listeners are ready for it (NRFD
+ * unasserted) and DAV is released as soon as they have all accepted it
+ * (NDAC unasserted). If eoi is set, EOI is asserted together with the last
+ * byte. Returns true on error.
+ */
+bool GPIB::gpibWriteBytes(const uint8_t *data, uint16_t n, bool eoi) {
+
+  bool err = false;
+
+  if (n == 0) return false;
+
+  // Wait for NDAC to go LOW (indicating that devices are at attention)
+  if (Wait_on_pin_us(LOW, NDAC, config.ltmo)) {
+    if (verbose()) controller.cmdstream->println(
+	  F("gpibWriteBytes: timeout waiting for receiver attention [NDAC asserted]"));
+    return true;
+  }
+
+  for (uint16_t i = 0; i < n; i++) {
+
+    // Wait for NRFD to go HIGH (indicating that receivers are ready)
+    if (Wait_on_pin_state(HIGH, NRFD, i ? config.btmo : config.rtmo)) {
+      if (verbose()) controller.cmdstream->println(
+	    F("gpibWriteBytes: timeout waiting for receiver ready - [NRFD unasserted]"));
+      err = true;
+      break;
+    }
+
+    // Place data on the bus, with EOI on the last byte
+    setGpibDbus(data[i]);
+    if (eoi && (i == n - 1)) setGpibState(0b00000000, 0b00010000, 0);
+
+    // Data settling time then assert DAV (data is valid - ready to collect)
+    delayMicroseconds(GPIB_T1);
+    setGpibState(0b00000000, 0b00001000, 0);
+
+    // Wait for NDAC to go HIGH (data accepted by all listeners)
+    if (Wait_on_pin_state(HIGH, NDAC, config.btmo)) {
+      if (verbose()) controller.cmdstream->println(
+	    F("gpibWriteBytes: timeout waiting for data accepted signal - [NDAC unasserted]"));
+      err = true;
+      break;
+    }
+
+    // Unassert DAV
+    setGpibState(0b00001000, 0b00001000, 0);
+
+    // Optional GPIB bus DELAY
+    if (config.tmbus) delayMicroseconds(config.tmbus);
+  }
+
+  // Unassert DAV and EOI, reset the data bus
+  setGpibState(0b00011000, 0b00011000, 0);
+  setGpibDbus(0);
+
+  return err;
+}
+
+
 /***** Write a SINGLE BYTE onto the GPIB bus using 3-way handshake *****/
 /*
  * (- this function is called in a loop to send data )
@@ -575,14 +1488,14 @@ bool GPIB::gpibWriteByte(uint8_t db) {
 bool GPIB::gpibWriteByteHandshake(uint8_t db) {
 
     // Wait for NDAC to go LOW (indicating that devices are at attention)
-  if (Wait_on_pin_state(LOW, NDAC, config.rtmo)) {
-    if (verbose()) controller.cmdstream->println(
+  if (Wait_on_pin_us(LOW, NDAC, config.atmo)) {
+    if (verbose()) msgStream()->println(
 	  F("gpibWriteByte: timeout waiting for receiver attention [NDAC asserted]"));
     return true;
   }
   // Wait for NRFD to go HIGH (indicating that receiver is ready)
-  if (Wait_on_pin_state(HIGH, NRFD, config.rtmo))  {
-    if (verbose()) controller.cmdstream->println(
+  if (Wait_on_pin_us(HIGH, NRFD, config.atmo))  {
+    if (verbose()) msgStream()->println(
 	  F("gpibWriteByte: timeout waiting for receiver ready - [NRFD unasserted]"));
     return true;
   }
@@ -594,15 +1507,15 @@ bool GPIB::gpibWriteByteHandshake(uint8_t db) {
   setGpibState(0b00000000, 0b00001000, 0);
 
   // Wait for NRFD to go LOW (receiver accepting data)
-  if (Wait_on_pin_state(LOW, NRFD, config.rtmo))  {
-    if (verbose()) controller.cmdstream->println(
+  if (Wait_on_pin_us(LOW, NRFD, config.atmo))  {
+    if (verbose()) msgStream()->println(
 	  F("gpibWriteByte: timeout waiting for data to be accepted - [NRFD asserted]"));
     return true;
   }
 
   // Wait for NDAC to go HIGH (data accepted)
-  if (Wait_on_pin_state(HIGH, NDAC, config.rtmo))  {
-    if (verbose()) controller.cmdstream->println(
+  if (Wait_on_pin_us(HIGH, NDAC, config.atmo))  {
+    if (verbose()) msgStream()->println(
 	  F("gpibWriteByte: timeout waiting for data accepted signal - [NDAC unasserted]"));
     return true;
   }
@@ -613,39 +1526,119 @@ bool GPIB::gpibWriteByteHandshake(uint8_t db) {
 
 /***** Untalk bus then address a device *****/
 /*
+ * saddr: secondary address (SCG byte, 96-126) sent after the device
+ *        address, 0=none;
  * dir: 0=listen; 1=talk;
  */
-bool GPIB::addrDev(uint8_t addr, bool dir) {
-  if (gpibSendCmd(GC_UNL)) return ERR;
-  if (dir) {
-    // Device to talk, controller to listen
-    if (gpibSendCmd(GC_TAD + addr)) return ERR;
-    if (gpibSendCmd(GC_LAD + config.caddr)) return ERR;
+bool GPIB::addrDev(uint8_t addr, uint8_t saddr, bool dir) {
+  uint8_t cmds[4];
+  uint8_t n = 0;
+  uint8_t talker = dir ? addr : config.caddr;
+  uint8_t listener = dir ? config.caddr : addr;
+  // Secondary address (SCG byte, 0=none) follows the device address
+  uint8_t tsa = dir ? saddr : 0;
+  uint8_t lsa = dir ? 0 : saddr;
+
+  if (config.addrcache && (addrKnown == 0x03)) {
+    // Bytes of the full sequence (UNL only when there are listeners)
+    uint8_t full = (busListeners ? 3 : 2) + (lsa ? 1 : 0) + (tsa ? 1 : 0);
+    // Only send what differs from the current bus addressing
+    if ((busListeners != (1UL << listener)) || (busListenerSa != lsa)) {
+      if (busListeners) cmds[n++] = GC_UNL;
+      cmds[n++] = GC_LAD + listener;
+      if (lsa) cmds[n++] = lsa;
+    }
+    if ((busTalker != talker) || (busTalkerSa != tsa)) {
+      cmds[n++] = GC_TAD + talker;
+      if (tsa) cmds[n++] = tsa;
+    }
+    addrSaved += full - n;
+    if (n == 0) return OK;
   } else {
-    // Device to listen, controller to talk
-    if (gpibSendCmd(GC_LAD + addr)) return ERR;
-    if (gpibSendCmd(GC_TAD + config.caddr)) return ERR;
+    cmds[n++] = GC_UNL;
+    cmds[n++] = GC_LAD + listener;
+    if (lsa) cmds[n++] = lsa;
+    cmds[n++] = GC_TAD + talker;
+    if (tsa) cmds[n++] = tsa;
   }
-  return OK;
+  return gpibSendCmds(cmds, n);
 }
 
 
 /***** Unaddress a device (untalk bus) *****/
+/*
+ * With the addressing cache enabled the listeners are left addressed, so
+ * that the next write to the same device needs no commands. A device
+ * that has been read from is still untalked: the rest of its output
+ * would otherwise be handshaken into the void by the next read.
+ */
 bool GPIB::uaddrDev() {
+  const uint8_t cmds[2] = { GC_UNL, GC_UNT };
+  if (config.addrcache && (addrKnown == 0x03)) {
+    if (busTalker == config.caddr) {
+      addrSaved += 2;
+      return OK;
+    }
+    addrSaved++;
+    delayMicroseconds(30);
+    return gpibSendCmd(GC_UNT);
+  }
   // De-bounce
   delayMicroseconds(30);
   // Utalk/unlisten
-  if (gpibSendCmd(GC_UNL)) return ERR;
-  if (gpibSendCmd(GC_UNT)) return ERR;
-  return OK;
+  return gpibSendCmds(cmds, 2);
+}
+
+
+/***** Forget the addressing state of the bus *****/
+/*
+ * Called on IFC, mode change and on errors/timeouts: the next
+ * addrDev() sends the full UNL/LAD/TAD sequence.
+ */
+void GPIB::clearAddrCache() {
+  addrKnown = 0;
+  busTalker = 0xFF;
+  busListeners = 0;
+  busTalkerSa = 0;
+  busListenerSa = 0;
+  lastPcg = 0;
+}
+
+
+/***** Track the addressing commands sent to the bus *****/
+void GPIB::trackCmd(uint8_t cmdByte) {
+  // Listeners are known from the last UNL, the talker from TAD or UNT
+  uint8_t pcg = 0;
+  if (cmdByte == GC_UNL) {
+    busListeners = 0;
+    busListenerSa = 0;
+    addrKnown |= 0x01;
+  } else if (cmdByte == GC_UNT) {
+    busTalker = 0xFF;
+    busTalkerSa = 0;
+    addrKnown |= 0x02;
+  } else if ((cmdByte & 0x60) == GC_LAD) {
+    busListeners |= 1UL << (cmdByte & 0x1F);
+    busListenerSa = 0;
+    pcg = GC_LAD;
+  } else if ((cmdByte & 0x60) == GC_TAD) {
+    // A new talker address untalks the previous talker
+    busTalker = cmdByte & 0x1F;
+    busTalkerSa = 0;
+    addrKnown |= 0x02;
+    pcg = GC_TAD;
+  } else if ((cmdByte & 0x60) == GC_SCG) {
+    // Secondary address of the LAD/TAD just sent
+    if (lastPcg == GC_LAD) busListenerSa = cmdByte;
+    if (lastPcg == GC_TAD) busTalkerSa = cmdByte;
+  }
+  lastPcg = pcg;
 }
 
 
 bool GPIB::takeControl(uint8_t addr) {
-  if (gpibSendCmd(GC_UNL)) return ERR;
-  if (gpibSendCmd(GC_UNT)) return ERR;
-  if (gpibSendCmd(GC_TAD + addr)) return ERR;
-  if (gpibSendCmd(GC_TCT)) return ERR;
+  uint8_t cmds[4] = { GC_UNL, GC_UNT, (uint8_t)(GC_TAD + addr), GC_TCT };
+  if (gpibSendCmds(cmds, 4)) return ERR;
   // put the controller in Device mode
   config.cmode = 1;
   initDevice();
@@ -664,19 +1657,40 @@ bool GPIB::takeControl(uint8_t addr) {
  */
 bool GPIB::Wait_on_pin_state(uint8_t state, uint8_t pin, int interval) {
 
-  unsigned long timeout = millis() + interval;
-  bool atnStat = (digitalRead(ATN) ? false : true); // Set to reverse - asserted=true; unasserted=false;
+  unsigned long start = millis();
+  bool atnStat = (getGpibPin(ATN) ? false : true); // Set to reverse - asserted=true; unasserted=false;
 
-  while (digitalRead(pin) != state) {
+  while (getGpibPin(pin) != state) {
     // Check timer
-    if (millis() >= timeout) return true;
+    if ((millis() - start) >= (unsigned long)interval) return true;
     // ATN status was asserted but now unasserted so abort
-    if (atnStat && (digitalRead(ATN)==HIGH)) return true;
+    if (atnStat && (getGpibPin(ATN)==HIGH)) return true;
     //    if (digitalRead(EOI)==LOW) tranBrk = 2;
   }
   return false;        // = no timeout therefore succeeded!
 }
 
+
+/***** Wait for a handshake line with a timeout in microseconds *****/
+/*
+ * Same as Wait_on_pin_state but timed with the handshake tick counter
+ * (see getHsTicks()), for steps that devices answer at bus speed.
+ */
+bool GPIB::Wait_on_pin_us(uint8_t state, uint8_t pin, uint32_t us) {
+
+  uint32_t ticks = hsUsToTicks(us);
+  uint32_t start = getHsTicks();
+  bool atnStat = (getGpibPin(ATN) ? false : true);
+
+  while (getGpibPin(pin) != state) {
+    // Check timer
+    if ((getHsTicks() - start) >= ticks) return true;
+    // ATN status was asserted but now unasserted so abort
+    if (atnStat && (getGpibPin(ATN)==HIGH)) return true;
+  }
+  return false;
+}
+
 /***** Control the GPIB bus - set various GPIB states *****/
 /*
  * state is a predefined state (CINI, CIDS, CCMS, CLAS, CTAS, DINI, DIDS, DLAS, DTAS);
@@ -707,164 +1721,92 @@ bool GPIB::Wait_on_pin_state(uint8_t state, uint8_t pin, int interval) {
  * +----+---------------++-----------+-----+-----+-------------------------+
  * H:high, L: low, T: transmit, R: receive, X: don't care
  */
-void GPIB::setGpibControls(uint8_t state) {
 
-  // Switch state
-  switch (state) {
-    // Controller states
-
-    case CINI:  // Initialisation
-      /* +-------------------------------------------------+
-       * | ATN | SRQ | REN | IFC | EOI | DAV | NDAC | NRFD |
-       * | OUT | IN  | OUT | IN  | OUT | OUT |  IN  |  IN  |
-       * |  H  | PU  |  L  | PU  |  H  |  H  |  PU  |  PU  | 
-       * +-------------------------------------------------+ */
-      // Set pin direction; ATN:O SRQ:I REN:O EOI:O DAV:O NRFD:I NDAC:I IFC:I
-      setGpibState(0b10111000, 0b11111111, 1);
-      // Set pin state; ATN:H SRQ:PU REN:L EOI:H DAV:H NRFD:PU NDAC:PU IFC:PU
-      setGpibState(0b11011111, 0b11111111, 0);
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,LOW);
-  #ifdef SN7516X_DC
-        digitalWrite(SN7516X_DC,LOW);
-  #endif
-  #ifdef SN7516X_SC
-        digitalWrite(SN7516X_SC,HIGH);
-  #endif
-#endif
-#ifdef DEBUG2
-      dbSerial->println(F("Initialised GPIB control mode"));
-#endif
-      break;
+/*
+ * Per-state control line settings (one row per state, CINI..DTAS):
+ *   dir   : pin direction; 0=input, 1=output
+ *   level : pin state; 0=LOW, 1=HIGH/INPUT_PULLUP
+ *   mask  : lines affected by the state; 0=unaffected, 1=enabled
+ *   te    : SN7516X TE level
+ *   flags : GS_CTRL/GS_DEV set SN7516X DC/SC for controller/device mode,
+ *           GS_DBUS_IN releases the data bus (listener states)
+ */
+#define GS_CTRL     0x01
+#define GS_DEV      0x02
+#define GS_DBUS_IN  0x04
+
+struct gpibCtrlState {
+  uint8_t dir;
+  uint8_t level;
+  uint8_t mask;
+  uint8_t te;
+  uint8_t flags;
+};
+
+static constexpr gpibCtrlState gpibCtrlStates[] = {
+  //  ATN SRQ REN EOI DAV NRFD NDAC IFC
+  { 0b10111000, 0b11011111, 0b11111111, LOW,  GS_CTRL },     // CINI: ATN:O/H SRQ:I/PU REN:O/L EOI:O/H DAV:O/H NRFD:I/PU NDAC:I/PU IFC:I/PU
+  { 0b10111000, 0b11011111, 0b10011110, LOW,  0 },           // CIDS: ATN:O/H EOI:O/H DAV:O/H NRFD:I/PU NDAC:I/PU
+  { 0b10111001, 0b01011111, 0b10011111, HIGH, 0 },           // CCMS: ATN:O/L EOI:O/H DAV:O/H NRFD:I/PU NDAC:I/PU IFC:O/H
+  { 0b10111001, 0b11011111, 0b10011110, HIGH, 0 },           // CTAS: ATN:O/H EOI:O/H DAV:O/H NRFD:I/PU NDAC:I/PU
+  { 0b10100110, 0b11011000, 0b10011110, LOW,  GS_DBUS_IN },  // CLAS: ATN:O/H EOI:I/PU DAV:I/PU NRFD:O/L NDAC:O/L
+  { 0b00000000, 0b11111111, 0b11111111, HIGH, GS_DEV },      // DINI: all lines I/PU
+  { 0b00000000, 0b11111111, 0b00001110, HIGH, 0 },           // DIDS: DAV:I/PU NRFD:I/PU NDAC:I/PU
+  { 0b00000110, 0b11111001, 0b00001110, LOW,  GS_DBUS_IN },  // DLAS: DAV:I/PU NRFD:O/L NDAC:O/L
+  { 0b00001000, 0b11111001, 0b00001110, HIGH, 0 },           // DTAS: DAV:O/H NRFD:I/PU NDAC:I/PU
+};
 
-    case CIDS:  // Controller idle state
-      /* +-------------------------------------------------+
-       * | ATN | SRQ | REN | IFC | EOI | DAV | NDAC | NRFD |
-       * | OUT |  -  |  -  |  -  | OUT | OUT |  IN  |  IN  |
-       * |  H  |  -  |  -  |  -  |  H  |  H  |  PU  |  PU  | 
-       * +-------------------------------------------------+ */
-      // ATN SRQ REN EOI DAV NRFD NDAC IFC
-      setGpibState(0b10111000, 0b10011110, 1);
-      setGpibState(0b11011111, 0b10011110, 0);
 #ifdef SN7516X
-      digitalWrite(SN7516X_TE,LOW);
-#endif
-#ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines to idle state"));
+/***** Set the SN7516X transceiver pins for a state *****/
+static void setGpibTransceiver(const gpibCtrlState &st) {
+  digitalWrite(SN7516X_TE, st.te);
+#ifdef SN7516X_DC
+  if (st.flags & GS_CTRL) digitalWrite(SN7516X_DC, LOW);
+  if (st.flags & GS_DEV) digitalWrite(SN7516X_DC, HIGH);
 #endif
-      break;
-
-    case CCMS:  // Controller active - send commands
-      /* +-------------------------------------------------+
-       * | ATN | SRQ | REN | IFC | EOI | DAV | NDAC | NRFD |
-       * | OUT |  -  |  -  | OUT | OUT | OUT |  IN  |  IN  |
-       * |  L  |  -  |  -  |  H  |  H  |  H  |  PU  |  PU  | 
-       * +-------------------------------------------------+ */
-      // ATN SRQ REN EOI DAV NRFD NDAC IFC
-      setGpibState(0b10111001, 0b10011111, 1);
-      setGpibState(0b01011111, 0b10011111, 0);
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,HIGH);
+#ifdef SN7516X_SC
+  if (st.flags & GS_CTRL) digitalWrite(SN7516X_SC, HIGH);
+  if (st.flags & GS_DEV) digitalWrite(SN7516X_SC, LOW);
 #endif
-#ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines for sending a command"));
+}
 #endif
-      break;
 
-    case CLAS:  // Controller - read data bus
-      /* +-------------------------------------------------+
-       * | ATN | SRQ | REN | IFC | EOI | DAV | NDAC | NRFD |
-       * | OUT |  -  |  -  |  -  | IN  |  IN | OUT  | OUT  |
-       * |  H  |  -  |  -  |  -  | PU  |  PU |  L   |  L   | 
-       * +-------------------------------------------------+ */
-      // ATN SRQ REN EOI DAV NRFD NDAC IFC
-      setGpibState(0b10100110, 0b10011110, 1);
-      setGpibState(0b11011000, 0b10011110, 0);
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,LOW);
-#endif
-#ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines for reading data"));
-#endif
-      break;
+void GPIB::setGpibControls(uint8_t state) {
 
-    case CTAS:  // Controller - write data bus
-      /* +-------------------------------------------------+
-       * | ATN | SRQ | REN | IFC | EOI | DAV | NDAC | NRFD |
-       * | OUT |  -  |  -  |  -  | OUT | OUT |  IN  |  IN  |
-       * |  H  |  -  |  -  |  -  |  H  |  H  |  PU  |  PU  | 
-       * +-------------------------------------------------+ */
-      // ATN SRQ REN EOI DAV NRFD NDAC IFC
-      setGpibState(0b10111001, 0b10011110, 1);
-      setGpibState(0b11011111, 0b10011110, 0);
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,HIGH);
-#endif
+  if ((state < CINI) || (state > DTAS)) {
 #ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines for writing data"));
+    // Should never get here!
+    dbSerial->println(F("Unknown GPIB state requested!"));
 #endif
-      break;
+    return;
+  }
 
-    /* Bits control lines as follows: 8-ATN, 7-SRQ, 6-REN, 5-EOI, 4-DAV, 3-NRFD, 2-NDAC, 1-IFC */
+  const gpibCtrlState &st = gpibCtrlStates[state - CINI];
 
-    // Listener states
-    case DINI:  // Listner initialisation
 #ifdef SN7516X
-      digitalWrite(SN7516X_TE,HIGH);
-  #ifdef SN7516X_DC
-        digitalWrite(SN7516X_DC,HIGH);
-  #endif
-  #ifdef SN7516X_SC
-        digitalWrite(SN7516X_SC,LOW);
-  #endif
-#endif
-      setGpibState(0b00000000, 0b11111111, 1);
-      setGpibState(0b11111111, 0b11111111, 0);
-#ifdef DEBUG2
-      dbSerial->println(F("Initialised GPIB listener mode"));
+  // Device mode: switch the transceivers before the lines
+  if (state >= DINI) setGpibTransceiver(st);
 #endif
-      break;
 
-    case DIDS:  // Device idle state
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,HIGH);
-#endif
-      setGpibState(0b00000000, 0b00001110, 1);
-      setGpibState(0b11111111, 0b00001110, 0);
-#ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines to idle state"));
-#endif
-      break;
+  // Set pin direction, then pin state
+  setGpibState(st.dir, st.mask, 1);
+  setGpibState(st.level, st.mask, 0);
 
-    case DLAS:  // Device listner active (actively listening - can handshake)
 #ifdef SN7516X
-      digitalWrite(SN7516X_TE,LOW);
-#endif
-      setGpibState(0b00000110, 0b00001110, 1);
-      setGpibState(0b11111001, 0b00001110, 0);
-#ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines to idle state"));
+  // Controller mode: switch the transceivers after the lines
+  if (state < DINI) setGpibTransceiver(st);
 #endif
-      break;
 
-    case DTAS:  // Device talker active (sending data)
-#ifdef SN7516X
-      digitalWrite(SN7516X_TE,HIGH);
-#endif
-      setGpibState(0b00001000, 0b00001110, 1);
-      setGpibState(0b11111001, 0b00001110, 0);
+  // Release the data bus (no-op if already listening)
+  if (st.flags & GS_DBUS_IN) readyGpibDbus();
+
 #ifdef DEBUG2
-      dbSerial->println(F("Set GPIB lines for listening as addresed device"));
+  dbSerial->print(F("Set GPIB control state: "));
+  dbSerial->println(state);
 #endif
-      break;
-#ifdef DEBUG2
 
-    default:
-      // Should never get here!
-      //      setGpibState(0b00000110, 0b10111001, 0b11111111);
-      dbSerial->println(F("Unknown GPIB state requested!"));
-#endif
-  }
+  // Lines already in this state: nothing to settle
+  if (state == cstate) return;
 
   // Save state
   cstate = state;
@@ -1096,8 +2038,11 @@ void GPIB::lonMode(){
  * When interrupts are being used the state is automatically flagged when
  * the ATN interrupt is triggered. Where the interrupt cannot be used the
  * state of the ATN line needs to be checked.
+ * In controller mode ATN is ours and is ignored: the interrupt flag also
+ * records the edges we make ourselves when addressing.
  */
 bool GPIB::isAtnAsserted() {
+  if (config.cmode == 2) return false;
 #ifndef USE_INTERRUPTS
   // no interrupt, so check the current value
   setATN(digitalRead(ATN) == LOW);
@@ -1108,6 +2053,8 @@ bool GPIB::isAtnAsserted() {
 
 void GPIB::assertIfc() {
   if (config.cmode==2) {
+    // IFC unaddresses all devices
+    clearAddrCache();
     // Assert IFC
     setGpibState(0b00000000, 0b00000001, 0);
     delayMicroseconds(150);
@@ -1124,7 +2071,7 @@ void GPIB::setATN(bool atn) {
  	  controller.cmdstream->print(F("ATN state changed to "));
  	  controller.cmdstream->println(atn);
 	}
-  ATNasserted = atn;
+  atnChange(atn);
 }
 
 void GPIB::setSRQ(bool srq) {
@@ -1133,5 +2080,50 @@ void GPIB::setSRQ(bool srq) {
  	  controller.cmdstream->print(F("SRQ state changed to "));
  	  controller.cmdstream->println(srq);
 	}
+#ifdef USE_INTERRUPTS
+  // The SRQ interrupt is the only producer of the SRQ event queue
+  SRQasserted = srq;
+#else
+  srqChange(srq);
+#endif
+}
+
+
+/***** Record an ATN line change (called from the ATN ISR) *****/
+void IRAM_ATTR GPIB::atnChange(bool atn) {
+  ATNasserted = atn;
+}
+
+
+/***** Record an SRQ line change (called from the SRQ ISR) *****/
+/*
+ * Each assertion of SRQ is timestamped (micros) into the SRQ event
+ * queue. The queue has a single producer (this function, called from
+ * the ISR, or from loop() through setSRQ() when the line is polled) and
+ * a single consumer (popSrqEvent) so it needs no lock: only the producer moves
+ * srqHead and only the consumer moves srqTail. Events are dropped when
+ * the queue is full.
+ */
+void IRAM_ATTR GPIB::srqChange(bool srq) {
+  if (srq && !SRQasserted) {
+    uint8_t next = (srqHead + 1) & (SRQ_QSIZE - 1);
+    if (next != srqTail) {
+      srqTime[srqHead] = micros();
+      srqHead = next;
+    }
+  }
   SRQasserted = srq;
 }
+
+
+/***** Get the timestamp of the oldest SRQ event *****/
+/*
+ * Returns false if the queue is empty.
+ */
+bool GPIB::popSrqEvent(uint32_t &t) {
+  uint8_t tail = srqTail;
+  if (tail == srqHead) return false;
+  t = srqTime[tail];
+  srqTail = (tail + 1) & (SRQ_QSIZE - 1);
+  return true;
+}
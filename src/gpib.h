@@ -2,6 +2,37 @@
 
 #include <Arduino.h>
 #include "controller.h"
+#include "terminator.h"
+
+/***** SRQ event queue size (power of 2) *****/
+#define SRQ_QSIZE 8
+
+/***** Data settling time before asserting DAV (IEEE 488.1 T1, microseconds) *****/
+#define GPIB_T1 2
+
+/***** Non-blocking transfer states (see xfrStep()) *****/
+#define XS_IDLE     0   // no transfer in progress
+#define XS_TX_LSTN  1   // write: waiting for the listeners (NDAC asserted)
+#define XS_TX_NRFD  2   // write: waiting for the listeners to be ready (NRFD unasserted)
+#define XS_TX_NDAC  3   // write: waiting for the byte to be accepted (NDAC unasserted)
+#define XS_RX_NRFD  4   // read: waiting for the other listeners to be ready
+#define XS_RX_DAV   5   // read: waiting for the talker (DAV asserted)
+#define XS_RX_DAVH  6   // read: waiting for the end of the byte (DAV unasserted)
+#define XS_DONE     7   // complete, waiting for xfrService() to hand the output over
+#define XS_QUEUED   8   // requested from loop(), not started by the GPIB task yet
+
+/***** Longest run of handshake steps in one xfrStep() call (microseconds) *****/
+#define XFR_SLICE_US 1000
+
+/***** Longest run of the GPIB task without sleeping for a tick (microseconds) *****/
+#define XFR_TASK_RUN_US 100000
+
+/***** Output staging buffer size (received data) *****/
+#ifdef ESP32
+#define OBUFSIZE 128
+#else
+#define OBUFSIZE 32
+#endif
 
 class GPIB {
 public:
@@ -12,20 +43,41 @@ public:
   void initPins();
 
   bool gpibSendCmd(uint8_t cmdByte);
+  bool gpibSendCmds(const uint8_t *cmds, uint8_t n);
   void gpibSendStatus();
   void gpibSendData(char *data, uint8_t dsize, bool bufferFull);
   bool gpibReceiveData();
+  bool gpibQuery(char *data, uint8_t dsize);
+  bool gpibWriteData(char *data, uint8_t dsize, bool bufferFull);
+  bool gpibQueryCapture(char *data, uint8_t dsize, uint8_t *buf, uint8_t size, uint8_t &len);
+  uint8_t gpibReadData();
   uint8_t gpibReadByte(uint8_t *db, bool *eoi);
   bool gpibWriteByte(uint8_t db);
   bool gpibWriteByteHandshake(uint8_t db);
+  bool gpibWriteBytes(const uint8_t *data, uint16_t n, bool eoi);
 
-  bool addrDev(uint8_t addr, bool dir);
+  bool addrDev(uint8_t addr, uint8_t saddr, bool dir);
   bool uaddrDev();
+  void clearAddrCache();
 
   bool takeControl(uint8_t);
-  bool findListeners(uint8_t addrs[31]);
+  bool findListeners(uint16_t *addrs, uint8_t size);
+  bool serialPoll(const uint8_t *addrs, uint8_t &n, uint8_t sa, int16_t *stb, bool rqsStop);
+  uint8_t parallelPoll();
+
+  /***** Non-blocking transfers, advanced by xfrStep() from loop() *****/
+  void xfrSend(char *data, uint8_t dsize, bool bufferFull, bool read);
+  void xfrReceive();
+  void xfrStep();
+  void xfrService();
+  void xfrWait();
+  bool xfrBreakable();
+  bool xfrBusy() {return xState != XS_IDLE;}
+#ifdef USE_GPIB_TASK
+  void startTask();
+#endif
 
-  bool isTerminatorDetected(uint8_t bytes[3], uint8_t eor_sequence);
+  void setTerminator();
   bool isAtnAsserted();
   void assertIfc();
 
@@ -33,6 +85,7 @@ public:
 
   /*****  GPIB CONTROL ROUTINES *****/
   bool Wait_on_pin_state(uint8_t state, uint8_t pin, int interval);
+  bool Wait_on_pin_us(uint8_t state, uint8_t pin, uint32_t us);
   void setGpibControls(uint8_t state);
 
   /***** Device mode GPIB command handling routines *****/
@@ -53,6 +106,9 @@ public:
   void clearSRQ() {SRQasserted = false;}
   void setATN(bool atn);
   void setSRQ(bool srq);
+  void atnChange(bool atn);
+  void srqChange(bool srq);
+  bool popSrqEvent(uint32_t &t);
 
   void setSrqSig();
   void clrSrqSig();
@@ -63,22 +119,129 @@ private:
   Controller &controller;
   AR488Conf &config;
 
+  // Addressing state of the bus, as set by the commands we have sent
+  uint8_t addrKnown = 0;        // bit 0: busListeners valid, bit 1: busTalker valid
+  uint8_t busTalker = 0xFF;     // addressed talker (0xFF=none)
+  uint32_t busListeners = 0;    // addressed listeners (bit n = address n)
+  uint8_t busTalkerSa = 0;      // secondary address (SCG) of the talker (0=none)
+  uint8_t busListenerSa = 0;    // secondary address (SCG) of the last listener (0=none)
+  uint8_t lastPcg = 0;          // last primary command (GC_LAD/GC_TAD) for a following SCG
+  void trackCmd(uint8_t cmdByte);
+  int8_t probeListener(uint8_t pa, uint8_t sa, uint8_t cnt);
+  bool findSecondary(uint8_t pa, uint8_t sa, uint8_t cnt, bool found,
+                     uint16_t *addrs, uint8_t size, uint8_t &n);
+
+  // Received data staged for output to the command stream
+  uint8_t oBuf[OBUFSIZE];
+  uint8_t oLen = 0;
+  unsigned long oTime = 0;      // millis() when the first staged byte was received
+  Stream *oStream = NULL;       // stream the received data goes to
+  void outByte(uint8_t c);
+  void outFlush();
+  Print *msgStream();
+  bool inTask();
+
+  // Read in progress (shared by gpibReadData() and the non-blocking read)
+  Terminator *rTerm = NULL;
+  uint32_t rxCount = 0;         // bytes read
+  bool rxEoi = false;           // EOI detected with the last byte
+  bool rEoiSaved = false;       // rEoi before the read
+  int8_t blkDigits = -1;        // block header: -1=none, 0='#' seen, >0=length digits to read
+  bool blkStart = true;         // block header: a '#' here may start one
+  uint32_t blkLen = 0;          // block header: payload length
+  uint32_t blkCnt = 0;          // block payload bytes still to read
+  void rxBegin();
+  bool rxData(uint8_t db, bool eoi);
+  void rxEnd(uint8_t r);
+  bool rxAddress();
+  void rxRelease(uint8_t r);
+  bool txAddress(bool bufferFull);
+  void txRelease(bool err);
+  uint8_t getEos(uint8_t *eos);
+
+  // Non-blocking transfer in progress, see xfrSend() and xfrReceive()
+  volatile uint8_t xState = XS_IDLE;
+  const uint8_t *xData = NULL;  // data to write, followed by xEos
+  uint16_t xLen = 0;
+  uint16_t xPos = 0;
+  uint8_t xEos[2];
+  uint8_t xNeos = 0;
+  bool xEoi = false;            // assert EOI with the last byte
+  bool xRead = false;           // read the response once written
+  uint8_t xByte = 0;            // byte being read
+  bool xByteEoi = false;
+  bool xUs = false;             // timing the current step in handshake ticks (else ms)
+  uint32_t xStart = 0;
+  uint32_t xTmo = 0;
+  void xfrTimer(uint32_t tmo, bool us);
+  bool xfrExpired();
+  void txStart(char *data, uint8_t dsize, bool bufferFull, bool read);
+  void rxStart();
+  void txStep();
+  void rxStep();
+  void rxFinish(uint8_t r);
+  void xfrDone();
+
+#ifdef USE_GPIB_TASK
+  // Transfer engine task, see startTask()
+  TaskHandle_t xTask = NULL;
+  volatile uint8_t xReq = 0;    // requested transfer: 1=send, 2=receive
+  char xReqBuf[PBSIZE];          // copy of the data to send
+  uint8_t xReqSize = 0;
+  bool xReqFull = false;
+  static void taskMain(void *arg);
+  // Received data, from the task to loop() (single producer, single consumer)
+  uint8_t oRing[GPIB_TASK_QSIZE];
+  volatile uint16_t oHead = 0;  // written by the task
+  volatile uint16_t oTail = 0;  // written by loop()
+  void outQueue(const uint8_t *buf, uint8_t n);
+  void outDrain();
+  // Messages of the task, queued with the received data
+  class TaskOut : public Print {
+  public:
+    TaskOut(GPIB &g) : gpib(g) {}
+    size_t write(uint8_t c) { gpib.outQueue(&c, 1); return 1; }
+  private:
+    GPIB &gpib;
+  };
+  TaskOut taskOut{*this};
+#endif
+
+  // Capture of received data (instead of output), see gpibQueryCapture()
+  uint8_t *capBuf = NULL;
+  uint8_t capSize = 0;
+  uint8_t capLen = 0;
+
+  // Receive terminator matchers (++eor sequence and ++read <char>)
+  Terminator eorTerm;
+  Terminator ebtTerm;
+
 public:
   // XXX should not be public...
   bool deviceAddressing = true;
   uint8_t cstate = 0;     // GPIB control state
-  uint8_t tranBrk = 0;    // Transmission break on 1=++, 2=EOI, 3=ATN 4=UNL
+  volatile uint8_t tranBrk = 0;    // Transmission break on 1=++, 2=EOI, 3=ATN 4=UNL
   bool aTt = false;       // currently unused
   bool aTl = false;       // currently unused
+  uint32_t addrSaved = 0; // Command bytes saved by the addressing cache
+
+  volatile bool ATNasserted = false;  // has ATN been asserted?
+  volatile bool SRQasserted = false;  // has SRQ been asserted?
 
-  bool ATNasserted = false;  // has ATN been asserted?
-  bool SRQasserted = false;  // has SRQ been asserted?
+  // SRQ events: timestamps (micros) of SRQ assertions, see srqChange()
+  volatile uint32_t srqTime[SRQ_QSIZE];
+  volatile uint8_t srqHead = 0;
+  volatile uint8_t srqTail = 0;
 
 public:  // TODO: fix this
   bool rEoi = false;      // Read eoi requested
   bool rEbt = false;      // Read with specified terminator character
+  bool rBlk = false;      // Read stops at the end of a definite length block
+  uint32_t rCnt = 0;      // Read stops after this number of bytes (0=disabled)
+  bool rNext = false;     // Reading past the first byte: use the inter-byte timeout
   uint8_t eByte = 0;      // Termination character
   bool isQuery = false;   // Direct instrument command is a query
+  bool xPrompt = false;   // Show the prompt when the non-blocking transfer is done
 
 
 };
@@ -102,7 +102,7 @@ void execMacro(String& macro, Controller& controller) {
 		// Reached last character before NL. Add to buffer before processing
 		if (i == ssize-1) {
 		  // Check buffer and add character
-		  if (controller.pbPtr < (PBSIZE - 2)) {
+		  if (controller.input->pbPtr < (PBSIZE - 2)) {
 			controller.addPbuf(c);
 		  } else {
 			// Buffer full - clear and exit
@@ -111,8 +111,10 @@ void execMacro(String& macro, Controller& controller) {
 			return;
 		  }
 		}
-		if (controller.isCmd(controller.pBuf)) {
+		if (controller.isCmd(controller.input->pBuf)) {
 		  controller.execCmd();
+		  // Complete a read started by the command before the next line
+		  controller.gpib->xfrWait();
 		} else {
 		  controller.sendToInstrument();
 		}
@@ -120,7 +122,7 @@ void execMacro(String& macro, Controller& controller) {
 		controller.flushPbuf();
 	  } else {
 		// Check buffer and add character
-		if (controller.pbPtr < (PBSIZE - 2)) {
+		if (controller.input->pbPtr < (PBSIZE - 2)) {
 		  controller.addPbuf(c);
 		} else {
 		  // Exceeds buffer size - clear buffer and exit
@@ -0,0 +1,44 @@
+#include <Arduino.h>
+#include "terminator.h"
+
+/***** Build the matcher for a terminator sequence *****/
+/*
+ * seq: bytes of the sequence in the order they are received
+ * n  : sequence length (0 disables the matcher)
+ */
+void Terminator::set(const uint8_t *seq, uint8_t n) {
+  uint8_t x = 0;  // State reached on the sequence shifted by one byte
+
+  if (n > TERM_MAXLEN) n = TERM_MAXLEN;
+  len = n;
+  state = 0;
+  nbytes = 0;
+  memset(bmap, 0, sizeof(bmap));
+#ifdef TERM_BYTE_TABLE
+  memset(column, 0, sizeof(column));
+#endif
+
+  // Distinct bytes of the sequence
+  for (uint8_t i = 0; i < n; i++) {
+    if ((bmap[seq[i] >> 3] & (1 << (seq[i] & 7))) == 0) {
+      bmap[seq[i] >> 3] |= (1 << (seq[i] & 7));
+      bytes[nbytes++] = seq[i];
+#ifdef TERM_BYTE_TABLE
+      column[seq[i]] = nbytes;
+#endif
+    }
+  }
+
+  if (n == 0) return;
+
+  // KMP automaton
+  for (uint8_t k = 0; k < nbytes; k++) {
+    next[0][k] = (bytes[k] == seq[0]) ? 1 : 0;
+  }
+  for (uint8_t j = 1; j < n; j++) {
+    for (uint8_t k = 0; k < nbytes; k++) {
+      next[j][k] = (bytes[k] == seq[j]) ? (j + 1) : next[x][k];
+    }
+    x = next[x][byteIdx(seq[j])];
+  }
+}
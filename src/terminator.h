@@ -0,0 +1,69 @@
+#if !defined(TERMINATOR_H)
+#define TERMINATOR_H
+
+#include <Arduino.h>
+
+/***** Maximum length of a terminator sequence *****/
+#define TERM_MAXLEN 8
+
+/***** Index the bytes of the sequence with a 256 entry table (RAM permitting) *****/
+#ifdef ESP32
+#define TERM_BYTE_TABLE
+#endif
+
+/***** Terminator sequence matcher *****/
+/*
+ * Detects a sequence of up to TERM_MAXLEN bytes in the received data
+ * using a KMP automaton built by set(). The state is the number of bytes
+ * of the sequence matched so far; a byte that is not part of the sequence
+ * returns to state 0, any other byte is one lookup in the transition
+ * table. With TERM_BYTE_TABLE, the column of the byte in the transition
+ * table comes from a 256 entry table; otherwise (AVR) from a bitmap and a
+ * search of the distinct bytes of the sequence.
+ */
+class Terminator {
+public:
+  void set(const uint8_t *seq, uint8_t n);
+  void reset() {state = 0;};
+  uint8_t length() {return len;};
+
+  /***** Process one received byte, true when the sequence is complete *****/
+  bool match(uint8_t c) {
+#ifdef TERM_BYTE_TABLE
+    uint8_t k = column[c];
+    if (k == 0) {
+      state = 0;
+      return false;
+    }
+    state = next[state][k - 1];
+#else
+    if ((bmap[c >> 3] & (1 << (c & 7))) == 0) {
+      state = 0;
+      return false;
+    }
+    state = next[state][byteIdx(c)];
+#endif
+    if (state < len) return false;
+    state = 0;
+    return true;
+  }
+
+private:
+  uint8_t len = 0;                // Sequence length (0=no terminator)
+  uint8_t state = 0;              // Number of bytes matched
+  uint8_t nbytes = 0;             // Number of distinct bytes in the sequence
+  uint8_t bytes[TERM_MAXLEN];     // Distinct bytes in the sequence
+  uint8_t bmap[32] = {0};         // Bitmap of the bytes in the sequence
+#ifdef TERM_BYTE_TABLE
+  uint8_t column[256] = {0};      // Per byte: distinct byte index + 1, 0=not in the sequence
+#endif
+  uint8_t next[TERM_MAXLEN][TERM_MAXLEN];  // Next state per state and distinct byte
+
+  uint8_t byteIdx(uint8_t c) {
+    uint8_t k = 0;
+    while (bytes[k] != c) k++;
+    return k;
+  }
+};
+
+#endif
@@ -0,0 +1,241 @@
+/***** Host build: Arduino core replacement *****/
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <WiFi.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "sim.h"
+#include "soc/gpio_struct.h"
+
+
+/***** Pins: through the fake GPIO registers *****/
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  simRegWrite(pin >> 5, (mode == OUTPUT) ? SIM_ENABLE_W1TS : SIM_ENABLE_W1TC, 1UL << (pin & 31));
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  simRegWrite(pin >> 5, val ? SIM_OUT_W1TS : SIM_OUT_W1TC, 1UL << (pin & 31));
+}
+
+int digitalRead(uint8_t pin) {
+  return (simRegRead(pin >> 5) >> (pin & 31)) & 1;
+}
+
+
+/***** Time: the simulation clock *****/
+/*
+ * Each call costs a little time so that the loops that wait on the
+ * clock alone always make progress.
+ */
+unsigned long millis() {
+  sim::advance(100);
+  return sim::now() / 1000000;
+}
+
+unsigned long micros() {
+  sim::advance(100);
+  return sim::now() / 1000;
+}
+
+static void sleepFor(uint64_t ns);
+
+void delay(unsigned long ms) {
+  sleepFor(ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sleepFor(us * 1000ULL);
+}
+
+uint32_t getCpuFrequencyMhz() {
+  return 240;
+}
+
+uint32_t EspClass::getCycleCount() {
+  sim::advance(10);
+  return (uint32_t)(sim::now() * 240 / 1000);
+}
+
+void EspClass::restart() {
+  fprintf(stderr, "ESP.restart()\n");
+  exit(1);
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode) { (void)pin; (void)isr; (void)mode; }
+void detachInterrupt(uint8_t pin) { (void)pin; }
+void noInterrupts() {}
+void interrupts() {}
+
+
+/***** FreeRTOS: the GPIB task *****/
+/*
+ * The task runs in a thread of its own, but never at the same time as
+ * loop(): the two take turns on the simulation clock, as if each core
+ * only worked while the other one sleeps. The side that runs is the one
+ * ready first. loop() sleeps in delay() and delayMicroseconds(), the task
+ * there too, in vTaskDelay() (taskYIELD() included) and while it waits for
+ * a notification. Without the task, sleeping only advances the clock.
+ */
+enum { SIDE_LOOP, SIDE_TASK };
+#define NEVER UINT64_MAX
+
+// Never destroyed: the task still waits on them when the test exits
+static std::mutex &turnLock = *new std::mutex;
+static std::condition_variable &turnChange = *new std::condition_variable;
+static std::thread::id taskThread;
+static bool taskStarted = false;
+static int turn = SIDE_LOOP;
+static uint64_t readyAt[2] = { 0, 0 };
+static uint32_t notified = 0;
+static int loopHandle, taskHandle;
+
+static int side() {
+  return (taskStarted && (std::this_thread::get_id() == taskThread)) ? SIDE_TASK : SIDE_LOOP;
+}
+
+/* Sleep until the clock reaches at (NEVER: until notified) */
+static void sleepUntil(uint64_t at) {
+  int me = side();
+  int other = 1 - me;
+  std::unique_lock<std::mutex> lock(turnLock);
+
+  readyAt[me] = at;
+  // The other side goes first when it is ready first (or at the same time)
+  if (taskStarted && (readyAt[other] <= readyAt[me])) {
+    if (readyAt[other] > sim::now()) sim::advance(readyAt[other] - sim::now());
+    turn = other;
+    turnChange.notify_all();
+    turnChange.wait(lock, [me] { return turn == me; });
+  }
+  if (readyAt[me] > sim::now()) sim::advance(readyAt[me] - sim::now());
+  readyAt[me] = sim::now();
+}
+
+static void sleepFor(uint64_t ns) {
+  sleepUntil(sim::now() + ns);
+}
+
+static void taskEntry(void (*fn)(void *), void *arg) {
+  {
+    std::unique_lock<std::mutex> lock(turnLock);
+    turnChange.wait(lock, [] { return turn == SIDE_TASK; });
+  }
+  fn(arg);
+}
+
+int xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack,
+                            void *arg, int prio, TaskHandle_t *task, int core) {
+  (void)name; (void)stack; (void)prio; (void)core;
+  std::lock_guard<std::mutex> lock(turnLock);
+  std::thread t(taskEntry, fn, arg);
+  taskThread = t.get_id();
+  t.detach();
+  taskStarted = true;
+  // Runs up to its first wait at the next sleep of loop()
+  readyAt[SIDE_TASK] = sim::now();
+  *task = &taskHandle;
+  return 1;
+}
+
+uint32_t ulTaskNotifyTake(int clear, uint32_t wait) {
+  uint32_t n;
+  (void)wait;
+  if (notified == 0) sleepUntil(NEVER);
+  n = notified;
+  notified = clear ? 0 : n - 1;
+  return n;
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+  (void)task;
+  std::lock_guard<std::mutex> lock(turnLock);
+  notified++;
+  if (readyAt[SIDE_TASK] == NEVER) readyAt[SIDE_TASK] = sim::now();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return (side() == SIDE_TASK) ? (TaskHandle_t)&taskHandle : (TaskHandle_t)&loopHandle;
+}
+
+void vTaskDelay(uint32_t ticks) {
+  sleepFor(ticks * 1000000ULL);
+}
+
+
+/***** Print *****/
+
+size_t Print::write(const uint8_t *buf, size_t n) {
+  for (size_t i = 0; i < n; i++) write(buf[i]);
+  return n;
+}
+
+static size_t printNum(Print *p, unsigned long n, int base, bool neg) {
+  char buf[40];
+  int i = sizeof(buf);
+  buf[--i] = 0;
+  do {
+    uint8_t d = n % base;
+    buf[--i] = (d < 10) ? ('0' + d) : ('A' + d - 10);
+    n /= base;
+  } while (n);
+  if (neg) buf[--i] = '-';
+  return p->print(buf + i);
+}
+
+size_t Print::print(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(const String &str) { return print(str.c_str()); }
+size_t Print::print(unsigned char n, int base) { return printNum(this, n, base, false); }
+size_t Print::print(unsigned n, int base) { return printNum(this, n, base, false); }
+size_t Print::print(unsigned long n, int base) { return printNum(this, n, base, false); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(long n, int base) {
+  if ((base == DEC) && (n < 0)) return printNum(this, -n, base, true);
+  return printNum(this, (unsigned long)n, base, false);
+}
+
+size_t Print::println() { return print("\r\n"); }
+size_t Print::println(const char *str) { return print(str) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(const String &str) { return print(str) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+
+
+/***** Serial port *****/
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t n) {
+  out.append((const char *)buf, n);
+  writes++;
+  return n;
+}
+
+int HardwareSerial::available() {
+  return in.size() - inPos;
+}
+
+int HardwareSerial::read() {
+  return available() ? (uint8_t)in[inPos++] : -1;
+}
+
+int HardwareSerial::peek() {
+  return available() ? (uint8_t)in[inPos] : -1;
+}
+
+
+HardwareSerial Serial;
+EspClass ESP;
+EEPROMClass EEPROM;
+WiFiClass WiFi;
+std::deque<std::shared_ptr<SimConn>> WiFiServer::pending;
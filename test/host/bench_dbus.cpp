@@ -0,0 +1,61 @@
+/***** Data bus access: register level vs digitalRead()/digitalWrite() *****/
+/*
+ * Built twice: bench_dbus with the ESP32 register access of the
+ * AR488_CUSTOM layout, bench_dbus_pin with the portable per pin code.
+ * Reports the GPIO register accesses per data bus read and write, and the
+ * byte rate of a 200 byte write and read at tmbus 0.
+ */
+
+#include "AR488_Layouts.h"
+#include "harness.h"
+
+static void busOps() {
+  const int n = 1000;
+  unsigned long acc;
+
+  readyGpibDbus();
+  sim::reset();
+  for (int i = 0; i < n; i++) readGpibDbus();
+  acc = sim::regReads + sim::regWrites;
+  printf("  readGpibDbus():  %5.1f register accesses\n", (double)acc / n);
+
+  sim::reset();
+  for (int i = 0; i < n; i++) setGpibDbus(i);
+  acc = sim::regReads + sim::regWrites;
+  printf("  setGpibDbus():   %5.1f register accesses\n", (double)acc / n);
+  readyGpibDbus();
+}
+
+/***** Byte rate on the bus, from the first to the last byte *****/
+static double rate(const sim::Device &dev) {
+  const std::vector<uint64_t> &t = dev.byteTimes;
+  return (t.size() - 1) * 1e9 / (t.back() - t.front());
+}
+
+int main(int argc, char **argv) {
+  sim::Device dev(5);
+  std::string big(200, 'x');
+
+  dev.replies["DATA?"] = big;
+
+  boot();
+  printf("%s data bus:\n", (argc > 1) ? argv[1] : "register");
+  busOps();
+
+  run("++addr 5");
+  run("++tmbus 0");
+  run("++read_tmo_ms 100");
+
+  run(big);
+  CHECK((dev.lines.size() == 1) && (dev.lines[0] == big));
+  printf("  write 200 bytes: %8.0f bytes/s\n", rate(dev));
+
+  run("++auto 0");
+  run("DATA?");
+  dev.byteTimes.clear();
+  CHECK(run("++read eoi").find(big) != std::string::npos);
+  printf("  read 200 bytes:  %8.0f bytes/s\n", rate(dev));
+
+  CHECK(dev.badBytes == 0);
+  return report("bench_dbus");
+}
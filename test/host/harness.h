@@ -0,0 +1,101 @@
+/***** Host build: test helpers *****/
+/*
+ * The firmware runs unchanged: setup() once, then loop() is called as
+ * on the board while the test feeds the serial port (or a TCP client)
+ * and watches the simulated bus.
+ */
+#ifndef HOST_HARNESS_H
+#define HOST_HARNESS_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <stdio.h>
+#include <vector>
+
+#include "controller.h"
+#include "gpib.h"
+#include "sim.h"
+
+extern Controller *controller;
+extern GPIB *gpib;
+void setup();
+void loop();
+
+static int failures = 0;
+static std::vector<std::shared_ptr<SimConn>> clients;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    failures++; \
+  } \
+} while (0)
+
+/***** Start the interface *****/
+static inline void boot() {
+  setup();
+  Serial.out.clear();
+}
+
+/***** Run loop() until the interface has been idle for a while *****/
+static inline bool idle() {
+  if (gpib->xfrBusy() || (controller->lnRdy != 0) || Serial.available()) return false;
+  if (!WiFiServer::pending.empty()) return false;
+  for (auto &c : clients) {
+    if (c->inPos < c->in.size()) return false;
+  }
+  return true;
+}
+
+static inline void settle() {
+  unsigned long n = 0;
+  for (uint8_t quiet = 0; quiet < 20; ) {
+    loop();
+    quiet = idle() ? quiet + 1 : 0;
+    if (++n > 10000000) {
+      printf("FAIL: interface never got idle\n");
+      failures++;
+      return;
+    }
+  }
+}
+
+/***** Run loop() for a while (e.g. during a continuous read) *****/
+static inline void runFor(uint32_t ms) {
+  uint64_t end = sim::now() + ms * 1000000ULL;
+  while (sim::now() < end) loop();
+}
+
+/***** Send a line on the serial port, return what the interface printed *****/
+static inline std::string run(const std::string &line) {
+  size_t from = Serial.out.size();
+  Serial.in += line + "\r";
+  settle();
+  return Serial.out.substr(from);
+}
+
+/***** Open a TCP connection to the interface *****/
+static inline std::shared_ptr<SimConn> connect() {
+  std::shared_ptr<SimConn> c = std::make_shared<SimConn>();
+  // The server is only polled once an SSID is set
+  strcpy(controller->config.ssid, "sim");
+  WiFiServer::pending.push_back(c);
+  clients.push_back(c);
+  settle();
+  return c;
+}
+
+/***** Send a line on a TCP connection, return what the interface wrote *****/
+static inline std::string run(SimConn &c, const std::string &line) {
+  size_t from = c.out.size();
+  c.in += line + "\r";
+  settle();
+  return c.out.substr(from);
+}
+
+static inline int report(const char *name) {
+  printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,307 @@
+/***** Host build: simulated GPIB bus *****/
+
+#include <algorithm>
+#include <string.h>
+
+#include "sim.h"
+#include "soc/gpio_struct.h"
+
+namespace sim {
+
+static uint64_t clockNs = 0;
+unsigned long regReads = 0;
+unsigned long regWrites = 0;
+std::vector<Cmd> cmdLog;
+
+static std::vector<Device *> devices;
+
+// Interface side: GPIO output and output enable registers of both banks
+static uint32_t outReg[2] = { 0, 0 };
+static uint32_t enableReg[2] = { 0, 0 };
+
+// Bus line of each GPIO (-1: not connected)
+static int8_t pinLine[64];
+static bool pinsMapped = false;
+
+static void mapPins() {
+  const uint8_t pins[16] = { DIO1, DIO2, DIO3, DIO4, DIO5, DIO6, DIO7, DIO8,
+                             EOI, DAV, NRFD, NDAC, IFC, SRQ, ATN, REN };
+  memset(pinLine, -1, sizeof(pinLine));
+  for (uint8_t l = 0; l < 16; l++) pinLine[pins[l]] = l;
+  pinsMapped = true;
+}
+
+
+uint64_t now() {
+  return clockNs;
+}
+
+void advance(uint64_t ns) {
+  clockNs += ns;
+}
+
+
+/***** Lines pulled LOW by the interface (output enabled, output LOW) *****/
+static uint16_t interfacePull() {
+  uint16_t low = 0;
+  for (uint8_t pin = 0; pin < 64; pin++) {
+    if (pinLine[pin] < 0) continue;
+    uint32_t bit = 1UL << (pin & 31);
+    if ((enableReg[pin >> 5] & bit) && !(outReg[pin >> 5] & bit)) low |= SIM_LINE(pinLine[pin]);
+  }
+  return low;
+}
+
+uint16_t levels() {
+  uint16_t low = interfacePull();
+  for (Device *d : devices) low |= d->pull;
+  return ~low;
+}
+
+
+/***** Record the command bytes (ATN asserted) as DAV is asserted *****/
+static void monitor(uint16_t lv) {
+  static bool davLow = false;
+  bool dav = !(lv & SIM_LINE(L_DAV));
+  if (dav && !davLow && !(lv & SIM_LINE(L_ATN))) {
+    cmdLog.push_back({ (uint8_t)~lv, clockNs });
+  }
+  davLow = dav;
+}
+
+
+/***** Let the devices answer until the bus is stable *****/
+static void settle() {
+  for (uint8_t i = 0; i < 16; i++) {
+    uint16_t lv = levels();
+    bool changed = false;
+    monitor(lv);
+    for (Device *d : devices) {
+      uint16_t p = d->pull;
+      d->step(lv);
+      if (d->pull != p) changed = true;
+    }
+    if (!changed) break;
+  }
+}
+
+
+void reset() {
+  regReads = 0;
+  regWrites = 0;
+  cmdLog.clear();
+}
+
+
+/***** Acceptor and source handshake states *****/
+enum { AH_IDLE, AH_READY, AH_WAITDAVH };
+enum { SH_IDLE, SH_WAITNDAC };
+
+#define DIO_LINES 0x00FF
+
+Device::Device(uint8_t pa) : pa(pa) {
+  devices.push_back(this);
+}
+
+Device::~Device() {
+  devices.erase(std::find(devices.begin(), devices.end(), this));
+}
+
+
+void Device::step(uint16_t lv) {
+  bool atn = !(lv & SIM_LINE(L_ATN));
+  bool dav = !(lv & SIM_LINE(L_DAV));
+
+  if (!(lv & SIM_LINE(L_IFC))) {
+    listening = talking = lpas = tpas = false;
+  }
+
+  // Acceptor: all devices during ATN, listeners otherwise
+  if (!(atn || listening)) {
+    pull &= ~(SIM_LINE(L_NRFD) | SIM_LINE(L_NDAC));
+    ah = AH_IDLE;
+  } else switch (ah) {
+    case AH_IDLE:
+      // Not accepted yet (NDAC), ready (NRFD released)
+      pull |= SIM_LINE(L_NDAC);
+      pull &= ~SIM_LINE(L_NRFD);
+      ah = AH_READY;
+      break;
+    case AH_READY:
+      if (dav) {
+        uint8_t b = ~lv & 0xFF;
+        bool eoi = !(lv & SIM_LINE(L_EOI));
+        // Not ready, data accepted
+        pull |= SIM_LINE(L_NRFD);
+        pull &= ~SIM_LINE(L_NDAC);
+        ah = AH_WAITDAVH;
+        if (atn) {
+          command(b);
+        } else {
+          if (minGapUs && ((clockNs - lastByte) < minGapUs * 1000ULL)) {
+            badBytes++;
+            b = 0x7F;
+          }
+          lastByte = clockNs;
+          byteTimes.push_back(clockNs);
+          data(b, eoi);
+        }
+      }
+      break;
+    case AH_WAITDAVH:
+      if (!dav) {
+        pull |= SIM_LINE(L_NDAC);
+        pull &= ~SIM_LINE(L_NRFD);
+        ah = AH_READY;
+      }
+      break;
+  }
+
+  // Source: the talker when ATN is unasserted
+  if (!(talking && !atn)) {
+    pull &= ~(DIO_LINES | SIM_LINE(L_EOI) | SIM_LINE(L_DAV));
+    sh = SH_IDLE;
+  } else switch (sh) {
+    case SH_IDLE:
+      if ((outPos < out.size()) && (clockNs >= outAt) &&
+          (lv & SIM_LINE(L_NRFD)) && !(lv & SIM_LINE(L_NDAC))) {
+        uint8_t b = out[outPos];
+        if (minGapUs && ((clockNs - lastByte) < minGapUs * 1000ULL)) {
+          badBytes++;
+          b = 0x7F;
+        }
+        pull |= b | SIM_LINE(L_DAV);
+        if (outPos == out.size() - 1) pull |= SIM_LINE(L_EOI);
+        sh = SH_WAITNDAC;
+      }
+      break;
+    case SH_WAITNDAC:
+      if (lv & SIM_LINE(L_NDAC)) {
+        pull &= ~(DIO_LINES | SIM_LINE(L_EOI) | SIM_LINE(L_DAV));
+        lastByte = clockNs;
+        byteTimes.push_back(clockNs);
+        outAt = clockNs + sendGapUs * 1000ULL;
+        if (++outPos == out.size()) {
+          out.clear();
+          outPos = 0;
+        }
+        sh = SH_IDLE;
+      }
+      break;
+  }
+}
+
+
+/***** Multiline command received *****/
+void Device::command(uint8_t b) {
+  b &= 0x7F;
+  bool mine = (b & 0x1F) == pa;
+
+  if (b >= 0x60) {
+    // Secondary address: applies after our own LAD or TAD
+    bool ok = std::find(sas.begin(), sas.end(), b) != sas.end();
+    if (lpas) listening = ok;
+    if (tpas) talking = ok;
+    if ((lpas || tpas) && ok) channel = b;
+    return;
+  }
+
+  // Any other primary command ends the wait for a secondary address
+  lpas = tpas = false;
+  if (b == 0x3F) {
+    listening = false;
+  } else if (b == 0x5F) {
+    talking = false;
+  } else if ((b & 0x60) == 0x20) {
+    if (mine) {
+      if (sas.empty()) listening = true; else lpas = true;
+    }
+  } else if ((b & 0x60) == 0x40) {
+    if (mine) {
+      if (sas.empty()) talking = true; else tpas = true;
+    } else {
+      talking = false;
+    }
+  } else if (b == 0x08) {
+    // GET
+    if (listening) triggers.push_back(clockNs);
+  } else if ((b == 0x14) || ((b == 0x04) && listening)) {
+    // DCL, SDC
+    inBuf.clear();
+    out.clear();
+    outPos = 0;
+  }
+}
+
+
+/***** Data byte received *****/
+void Device::data(uint8_t b, bool eoi) {
+  if ((b != '\r') && (b != '\n')) inBuf += (char)b;
+  if ((b == '\n') || eoi) {
+    lines.push_back(inBuf);
+    reply(inBuf);
+    inBuf.clear();
+  }
+}
+
+
+/***** Prepare the reply to a query *****/
+void Device::reply(const std::string &line) {
+  std::string r;
+  if (line == "*IDN?") {
+    r = idn;
+    if (channel) r += "," + std::to_string(channel);
+  } else if (replies.count(line)) {
+    r = replies[line];
+  } else {
+    return;
+  }
+  out = r + "\n";
+  outPos = 0;
+  outAt = clockNs + respUs * 1000ULL;
+}
+
+}  // namespace sim
+
+
+/***** Fake GPIO registers *****/
+
+gpio_dev_t GPIO = {
+  { 0, SIM_OUT_W1TS }, { 0, SIM_OUT_W1TC },
+  { { 1, SIM_OUT_W1TS } }, { { 1, SIM_OUT_W1TC } },
+  { 0, SIM_ENABLE_W1TS }, { 0, SIM_ENABLE_W1TC },
+  { { 1, SIM_ENABLE_W1TS } }, { { 1, SIM_ENABLE_W1TC } },
+  { 0 }, { { 1 } }
+};
+
+uint32_t simRegRead(uint8_t bank) {
+  using namespace sim;
+  uint32_t val = 0xFFFFFFFF;
+  uint16_t lv;
+
+  if (!pinsMapped) mapPins();
+  regReads++;
+  advance(SIM_REG_NS);
+  settle();
+  lv = levels();
+  for (uint8_t i = 0; i < 32; i++) {
+    int8_t l = pinLine[bank * 32 + i];
+    if ((l >= 0) && !(lv & SIM_LINE(l))) val &= ~(1UL << i);
+  }
+  return val;
+}
+
+void simRegWrite(uint8_t bank, uint8_t reg, uint32_t val) {
+  using namespace sim;
+
+  if (!pinsMapped) mapPins();
+  regWrites++;
+  advance(SIM_REG_NS);
+  switch (reg) {
+    case SIM_OUT_W1TS: outReg[bank] |= val; break;
+    case SIM_OUT_W1TC: outReg[bank] &= ~val; break;
+    case SIM_ENABLE_W1TS: enableReg[bank] |= val; break;
+    case SIM_ENABLE_W1TC: enableReg[bank] &= ~val; break;
+  }
+  settle();
+}
@@ -0,0 +1,97 @@
+/***** Host build: simulated GPIB bus *****/
+/*
+ * The interface drives the bus through the fake GPIO registers (see
+ * stub/soc/gpio_struct.h) or through digitalWrite()/pinMode(). A line is
+ * LOW (asserted) when the interface or any device pulls it LOW. Devices
+ * run the IEEE 488.1 source and acceptor handshakes: they are stepped
+ * each time the interface accesses a register, so that they always see
+ * the current state of the bus and answer at bus speed.
+ *
+ * Time is simulated: each register access costs SIM_REG_NS, delays and
+ * device response times advance the clock. Results are deterministic.
+ */
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/***** Cost of a GPIO register access (nanoseconds) *****/
+#define SIM_REG_NS 50
+
+namespace sim {
+
+/***** Bus lines (bit n of a line mask) *****/
+enum {
+  L_DIO1, L_DIO2, L_DIO3, L_DIO4, L_DIO5, L_DIO6, L_DIO7, L_DIO8,
+  L_EOI, L_DAV, L_NRFD, L_NDAC, L_IFC, L_SRQ, L_ATN, L_REN
+};
+#define SIM_LINE(l) (1U << (l))
+
+/***** Clock (nanoseconds) *****/
+uint64_t now();
+void advance(uint64_t ns);
+
+/***** Register accesses made by the interface *****/
+extern unsigned long regReads;
+extern unsigned long regWrites;
+
+/***** Command bytes seen on the bus (ATN asserted) *****/
+struct Cmd {
+  uint8_t byte;
+  uint64_t t;
+};
+extern std::vector<Cmd> cmdLog;
+
+/***** Simulated instrument *****/
+class Device {
+public:
+  Device(uint8_t pa);
+  ~Device();
+
+  uint8_t pa;                   // primary address
+  std::vector<uint8_t> sas;     // secondary addresses (none: primary only)
+  std::string idn;              // *IDN? reply ("<idn>,<secondary>" on a channel)
+  std::map<std::string, std::string> replies;  // other queries
+  uint32_t respUs = 20;         // delay before the reply to a query is ready
+  uint32_t sendGapUs = 0;       // pause between the bytes of a reply
+  uint32_t minGapUs = 0;        // shortest time between two data bytes it copes with
+
+  // Observed by the tests
+  bool listening = false;
+  bool talking = false;
+  uint8_t channel = 0;          // secondary address in use (0=none)
+  std::vector<std::string> lines;   // data lines received
+  std::vector<uint64_t> triggers;   // time of each GET received as a listener
+  std::vector<uint64_t> byteTimes;  // time of each data byte sent or received
+  unsigned long badBytes = 0;   // data bytes sent or received too close together
+
+  void step(uint16_t levels);
+  uint16_t pull = 0;            // lines pulled LOW by the device
+
+private:
+  uint8_t ah = 0;               // acceptor handshake state
+  uint8_t sh = 0;               // source handshake state
+  bool lpas = false;            // our LAD seen, waiting for a secondary address
+  bool tpas = false;            // our TAD seen, waiting for a secondary address
+  uint64_t lastByte = 0;        // time of the last data byte
+  std::string inBuf;
+  std::string out;
+  size_t outPos = 0;
+  uint64_t outAt = 0;           // time the reply is ready
+  void command(uint8_t b);
+  void data(uint8_t b, bool eoi);
+  void reply(const std::string &line);
+};
+
+/***** Reset the register counters and the command log *****/
+void reset();
+
+/***** Levels of the bus lines (1=HIGH) *****/
+uint16_t levels();
+
+}  // namespace sim
+
+#endif
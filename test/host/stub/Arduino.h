@@ -0,0 +1,148 @@
+/***** Host build: Arduino core replacement *****/
+/*
+ * Just what the firmware uses, for an ESP32 target. Time is simulated
+ * (see sim.h): millis(), micros() and the cycle counter read the bus
+ * simulation clock, delay() and delayMicroseconds() advance it.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 3
+#define FALLING 2
+#define HEX 16
+#define DEC 10
+#define BIN 2
+#define IRAM_ATTR
+#define PROGMEM
+#define F(x) x
+#define LED_BUILTIN 2
+#define pgm_read_byte_near(p) (*(const uint8_t *)(p))
+#define strlen_P strlen
+#define digitalPinToInterrupt(p) (p)
+#define WRITE_PERI_REG(a, b) ((void)(a), (void)(b))
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode);
+void detachInterrupt(uint8_t pin);
+void noInterrupts();
+void interrupts();
+uint32_t getCpuFrequencyMhz();
+
+class String {
+public:
+  std::string s;
+  String() {}
+  String(const char *c) : s(c) {}
+  String(int v) : s(std::to_string(v)) {}
+  String(unsigned v) : s(std::to_string(v)) {}
+  String(long v) : s(std::to_string(v)) {}
+  String(unsigned long v) : s(std::to_string(v)) {}
+  String operator+(const String &o) const { String r; r.s = s + o.s; return r; }
+  String operator+(const char *o) const { String r; r.s = s + o; return r; }
+  String operator+(int o) const { return *this + String(o); }
+  String operator+(unsigned o) const { return *this + String(o); }
+  String operator+(long o) const { return *this + String(o); }
+  String operator+(unsigned long o) const { return *this + String(o); }
+  String operator+(char c) const { String r; r.s = s + c; return r; }
+  String &operator=(const char *c) { s = c; return *this; }
+  char operator[](int i) const { return s[i]; }
+  unsigned length() const { return s.size(); }
+  void trim() {}
+  const char *c_str() const { return s.c_str(); }
+};
+inline String operator+(const char *a, const String &b) { return String(a) + b; }
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t n);
+  size_t write(const char *buf, size_t n) { return write((const uint8_t *)buf, n); }
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(const String &str);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t println();
+  size_t println(const char *str);
+  size_t println(char c);
+  size_t println(const String &str);
+  size_t println(unsigned char n, int base = DEC);
+  size_t println(int n, int base = DEC);
+  size_t println(unsigned n, int base = DEC);
+  size_t println(long n, int base = DEC);
+  size_t println(unsigned long n, int base = DEC);
+  virtual void flush() {}
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual int availableForWrite() { return 0; }
+};
+
+/* Serial port: input fed by the test, output captured for it */
+class HardwareSerial : public Stream {
+public:
+  std::string in;
+  size_t inPos = 0;
+  std::string out;
+  unsigned long writes = 0;     // write calls (one per print() chunk)
+  void begin(unsigned long baud) { (void)baud; }
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buf, size_t n) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  void restart();
+  uint32_t getCycleCount();
+};
+extern EspClass ESP;
+
+/* FreeRTOS (only what the GPIB task code refers to, see arduino.cpp) */
+typedef void *TaskHandle_t;
+#define portMAX_DELAY 0xffffffff
+#define pdTRUE 1
+#define taskYIELD() vTaskDelay(0)
+#ifndef ARDUINO_RUNNING_CORE
+#define ARDUINO_RUNNING_CORE 1
+#endif
+int xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack,
+                            void *arg, int prio, TaskHandle_t *task, int core);
+uint32_t ulTaskNotifyTake(int clear, uint32_t wait);
+void xTaskNotifyGive(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+void vTaskDelay(uint32_t ticks);
+
+#endif
@@ -0,0 +1,17 @@
+/***** Host build: EEPROM (unused on ESP32) *****/
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <Arduino.h>
+
+struct EEPROMClass {
+  template<typename T> T &get(int addr, T &t) { (void)addr; return t; }
+  template<typename T> const T &put(int addr, const T &t) { (void)addr; return t; }
+  uint8_t read(int addr) { (void)addr; return 0xFF; }
+  void write(int addr, uint8_t val) { (void)addr; (void)val; }
+  bool commit() { return true; }
+  void begin(size_t size) { (void)size; }
+};
+extern EEPROMClass EEPROM;
+
+#endif
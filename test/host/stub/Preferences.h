@@ -0,0 +1,31 @@
+/***** Host build: ESP32 Preferences, with nothing stored *****/
+#ifndef HOST_PREFERENCES_H
+#define HOST_PREFERENCES_H
+
+#include <Arduino.h>
+
+class Preferences {
+public:
+  bool begin(const char *name, bool ro) { (void)name; (void)ro; return true; }
+  void end() {}
+  bool isKey(const char *key) { (void)key; return false; }
+  bool getBool(const char *key, bool v) { (void)key; return v; }
+  uint8_t getUChar(const char *key, uint8_t v) { (void)key; return v; }
+  int8_t getChar(const char *key, int8_t v) { (void)key; return v; }
+  uint16_t getUShort(const char *key, uint16_t v) { (void)key; return v; }
+  int32_t getInt(const char *key, int32_t v) { (void)key; return v; }
+  uint32_t getUInt(const char *key, uint32_t v) { (void)key; return v; }
+  uint32_t getULong(const char *key, uint32_t v) { (void)key; return v; }
+  size_t getBytesLength(const char *key) { (void)key; return 0; }
+  size_t getBytes(const char *key, void *buf, size_t n) { (void)key; (void)buf; (void)n; return 0; }
+  size_t putBool(const char *key, bool v) { (void)key; (void)v; return 1; }
+  size_t putUChar(const char *key, uint8_t v) { (void)key; (void)v; return 1; }
+  size_t putChar(const char *key, int8_t v) { (void)key; (void)v; return 1; }
+  size_t putUShort(const char *key, uint16_t v) { (void)key; (void)v; return 2; }
+  size_t putInt(const char *key, int32_t v) { (void)key; (void)v; return 4; }
+  size_t putUInt(const char *key, uint32_t v) { (void)key; (void)v; return 4; }
+  size_t putBytes(const char *key, const void *buf, size_t n) { (void)key; (void)buf; return n; }
+  bool remove(const char *key) { (void)key; return true; }
+};
+
+#endif
@@ -0,0 +1,74 @@
+/***** Host build: ESP32 WiFi, with the clients created by the test *****/
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include <Arduino.h>
+#include <deque>
+#include <memory>
+
+#define WL_CONNECTED 3
+#define WIFI_AUTH_OPEN 0
+
+class IPAddress {
+public:
+  operator String() const { return String("10.0.0.2"); }
+};
+
+/* Both ends of a TCP connection */
+struct SimConn {
+  std::string in;               // sent by the client, read by the interface
+  size_t inPos = 0;
+  std::string out;              // written by the interface
+  unsigned long writes = 0;     // write calls, i.e. TCP segments with no delay
+  bool open = true;
+};
+
+class WiFiClient : public Stream {
+public:
+  std::shared_ptr<SimConn> conn;
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t n) override {
+    if (!conn || !conn->open) return 0;
+    conn->out.append((const char *)buf, n);
+    conn->writes++;
+    return n;
+  }
+  int available() override { return conn ? (int)(conn->in.size() - conn->inPos) : 0; }
+  int read() override { return available() ? (uint8_t)conn->in[conn->inPos++] : -1; }
+  int peek() override { return available() ? (uint8_t)conn->in[conn->inPos] : -1; }
+  bool connected() { return conn && conn->open; }
+  void stop() { conn.reset(); }
+  IPAddress remoteIP() { return IPAddress(); }
+  operator bool() { return (bool)conn; }
+  void setNoDelay(bool nodelay) { (void)nodelay; }
+};
+
+class WiFiServer {
+public:
+  WiFiServer(int port) { (void)port; }
+  void begin() {}
+  void setNoDelay(bool nodelay) { (void)nodelay; }
+  bool hasClient() { return !pending.empty(); }
+  WiFiClient available() {
+    WiFiClient c;
+    if (!pending.empty()) {
+      c.conn = pending.front();
+      pending.pop_front();
+    }
+    return c;
+  }
+  static std::deque<std::shared_ptr<SimConn>> pending;  // connections to accept
+};
+
+class WiFiClass {
+public:
+  int status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+  int scanNetworks() { return 0; }
+  String SSID(int i) { (void)i; return String(); }
+  int RSSI(int i) { (void)i; return 0; }
+  int encryptionType(int i) { (void)i; return WIFI_AUTH_OPEN; }
+};
+extern WiFiClass WiFi;
+
+#endif
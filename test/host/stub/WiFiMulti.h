@@ -0,0 +1,13 @@
+/***** Host build: ESP32 WiFiMulti *****/
+#ifndef HOST_WIFIMULTI_H
+#define HOST_WIFIMULTI_H
+
+#include <WiFi.h>
+
+class WiFiMulti {
+public:
+  void addAP(const char *ssid, const char *pass) { (void)ssid; (void)pass; }
+  int run() { return WL_CONNECTED; }
+};
+
+#endif
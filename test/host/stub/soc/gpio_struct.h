@@ -0,0 +1,44 @@
+/***** Host build: ESP32 GPIO registers *****/
+/*
+ * Each register access goes to the bus simulation (see sim.h): a read
+ * returns the levels of the bus lines, a write drives them.
+ */
+#ifndef HOST_GPIO_STRUCT_H
+#define HOST_GPIO_STRUCT_H
+
+#include <stdint.h>
+
+enum {
+  SIM_OUT_W1TS, SIM_OUT_W1TC, SIM_ENABLE_W1TS, SIM_ENABLE_W1TC
+};
+
+uint32_t simRegRead(uint8_t bank);
+void simRegWrite(uint8_t bank, uint8_t reg, uint32_t val);
+
+struct SimRegIn {
+  uint8_t bank;
+  operator uint32_t() const { return simRegRead(bank); }
+};
+
+struct SimRegSet {
+  uint8_t bank;
+  uint8_t reg;
+  void operator=(uint32_t val) const { simRegWrite(bank, reg, val); }
+};
+
+// Bank 1 registers are accessed through their .val member
+struct SimBankIn { SimRegIn val; };
+struct SimBankSet { SimRegSet val; };
+
+typedef struct {
+  SimRegSet out_w1ts, out_w1tc;
+  SimBankSet out1_w1ts, out1_w1tc;
+  SimRegSet enable_w1ts, enable_w1tc;
+  SimBankSet enable1_w1ts, enable1_w1tc;
+  SimRegIn in;
+  SimBankIn in1;
+} gpio_dev_t;
+
+extern gpio_dev_t GPIO;
+
+#endif
@@ -0,0 +1,5 @@
+/***** Host build: ESP32 RTC registers *****/
+#ifndef HOST_RTC_CNTL_REG_H
+#define HOST_RTC_CNTL_REG_H
+#define RTC_CNTL_BROWN_OUT_REG 0
+#endif
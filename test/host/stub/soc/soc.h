@@ -0,0 +1,4 @@
+/***** Host build: ESP32 SoC definitions *****/
+#ifndef HOST_SOC_H
+#define HOST_SOC_H
+#endif
@@ -0,0 +1,59 @@
+/***** Command bursts: gpibSendCmds() vs one gpibSendCmd() per byte *****/
+
+#include "harness.h"
+
+/***** Address device 5 to listen, one byte at a time or in one burst *****/
+static uint64_t address(bool burst, unsigned long &acc) {
+  const uint8_t cmds[3] = { GC_UNL, GC_LAD + 5, GC_TAD + 0 };
+  uint64_t t;
+
+  sim::reset();
+  t = sim::now();
+  if (burst) {
+    CHECK(gpib->gpibSendCmds(cmds, 3) == OK);
+  } else {
+    for (uint8_t i = 0; i < 3; i++) CHECK(gpib->gpibSendCmd(cmds[i]) == OK);
+  }
+  t = sim::now() - t;
+  acc = sim::regReads + sim::regWrites;
+
+  CHECK(sim::cmdLog.size() == 3);
+  for (size_t i = 0; (i < 3) && (i < sim::cmdLog.size()); i++) CHECK(sim::cmdLog[i].byte == cmds[i]);
+  gpib->setGpibControls(CIDS);
+  return t;
+}
+
+int main() {
+  sim::Device dev(5);
+  unsigned long acc;
+  uint64_t t;
+
+  boot();
+  run("++addrcache 0");
+
+  for (uint16_t tmbus : { 0, 20 }) {
+    controller->config.tmbus = tmbus;
+    printf("tmbus %u:\n", tmbus);
+
+    t = address(false, acc);
+    CHECK(dev.listening);
+    printf("  UNL LAD TAD, 3 x gpibSendCmd(): %6.2f us, %3lu register accesses\n", t / 1000.0, acc);
+
+    gpib->uaddrDev();
+    CHECK(!dev.listening);
+
+    t = address(true, acc);
+    CHECK(dev.listening);
+    printf("  UNL LAD TAD, gpibSendCmds():    %6.2f us, %3lu register accesses\n", t / 1000.0, acc);
+
+    // addrDev() sends the same burst
+    gpib->uaddrDev();
+    sim::reset();
+    CHECK(gpib->addrDev(5, 0, 0) == OK);
+    CHECK(sim::cmdLog.size() == 3);
+    CHECK(dev.listening);
+    gpib->uaddrDev();
+  }
+
+  return report("test_cmdburst");
+}
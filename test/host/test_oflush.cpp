@@ -0,0 +1,69 @@
+/***** Staged output: stream write calls per read, flush_tmo_ms 0 vs 5 *****/
+
+#include "harness.h"
+
+/***** Read the reply of device 5, count the write calls to the stream *****/
+static unsigned long readReply(SimConn *c, const std::string &reply, const char *what) {
+  std::string out;
+  unsigned long w;
+
+  if (c) {
+    run(*c, "DATA?");
+    w = c->writes;
+    out = run(*c, "++read eoi");
+    w = c->writes - w;
+  } else {
+    run("DATA?");
+    w = Serial.writes;
+    out = run("++read eoi");
+    w = Serial.writes - w;
+  }
+  CHECK(out.find(reply) == 0);
+  printf("  %-6s %4zu bytes: %4lu writes\n", what, out.size(), w);
+  return w;
+}
+
+/***** Expected number of writes *****/
+/*
+ * The output of the GPIB task is written by loop() as it drains the ring:
+ * what was queued since the last pass goes out in one write.
+ */
+static bool writes(unsigned long w, unsigned long expected) {
+#ifdef USE_GPIB_TASK
+  return (w > 0) && (w <= expected);
+#else
+  return w == expected;
+#endif
+}
+
+int main() {
+  sim::Device dev(5);
+  std::string big(1000, 'x');
+  std::string slow("12345");
+  std::shared_ptr<SimConn> c;
+
+  dev.replies["DATA?"] = big;
+  boot();
+  c = connect();
+  for (const char *cmd : { "++addr 5", "++auto 0", "++read_tmo_ms 100" }) {
+    run(cmd);
+    run(*c, cmd);
+  }
+
+  for (int oflush : { 0, 5 }) {
+    std::string cmd = "++flush_tmo_ms " + std::to_string(oflush);
+    run(cmd);
+    run(*c, cmd);
+    printf("flush_tmo_ms %d:\n", oflush);
+    CHECK(writes(readReply(NULL, big, "serial"), oflush ? 8 : big.size() + 1));
+    CHECK(writes(readReply(c.get(), big, "tcp"), oflush ? 8 : big.size() + 1));
+  }
+
+  // A talker slower than the flush deadline: each byte is written on time
+  dev.replies["DATA?"] = slow;
+  dev.sendGapUs = 10000;
+  printf("flush_tmo_ms 5, 10ms between bytes:\n");
+  CHECK(writes(readReply(c.get(), slow, "tcp"), slow.size() + 1));
+
+  return report("test_oflush");
+}
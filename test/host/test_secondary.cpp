@@ -0,0 +1,70 @@
+/***** Secondary addresses: a mainframe with three channels *****/
+
+#include "harness.h"
+
+/***** Secondary address bytes (SCG) in the command log *****/
+static size_t scgBytes() {
+  size_t n = 0;
+  for (const sim::Cmd &c : sim::cmdLog) {
+    if ((c.byte & 0x60) == GC_SCG) n++;
+  }
+  return n;
+}
+
+int main() {
+  sim::Device frame(5), dmm(6);
+
+  frame.sas = { 96, 97, 98 };
+  frame.idn = "MAINFRAME";
+  dmm.idn = "DMM";
+
+  boot();
+  run("++auto 2");
+
+  // Each channel answers with its secondary address
+  for (int sa : { 96, 97, 98 }) {
+    run("++addr 5 " + std::to_string(sa));
+    sim::reset();
+    CHECK(run("*IDN?") == "MAINFRAME," + std::to_string(sa) + "\n");
+    CHECK(scgBytes() == 2);
+    CHECK(frame.lines.back() == "*IDN?");
+  }
+
+  // Not a channel of the mainframe: nobody listens
+  run("++addr 5 100");
+  CHECK(run("*IDN?") == "");
+  CHECK(!frame.listening);
+
+  // Primary address only
+  run("++addr 6");
+  sim::reset();
+  CHECK(run("*IDN?") == "DMM\n");
+  CHECK(scgBytes() == 0);
+
+  // With the addressing cache, writing again to the same channel sends
+  // no command byte at all
+  run("++addrcache 1");
+  run("++addr 5 97");
+  run("CONF A");
+  sim::reset();
+  run("CONF B");
+  CHECK(sim::cmdLog.empty());
+  CHECK(frame.lines.back() == "CONF B");
+  CHECK(frame.channel == 97);
+
+  // Another channel: readdressed with its SCG
+  run("++addr 5 98");
+  sim::reset();
+  run("CONF C");
+  CHECK(scgBytes() == 1);
+  CHECK(frame.channel == 98);
+
+  // A device read from is still untalked after the read
+  run("++addr 6");
+  sim::reset();
+  CHECK(run("*IDN?") == "DMM\n");
+  CHECK(!sim::cmdLog.empty() && (sim::cmdLog.back().byte == GC_UNT));
+  CHECK(!dmm.talking);
+
+  return report("test_secondary");
+}
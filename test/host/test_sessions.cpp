@@ -0,0 +1,114 @@
+/***** TCP sessions: settings and replies kept apart *****/
+
+#include <algorithm>
+
+#include "harness.h"
+
+#define NQUERIES 20
+#define QUERY_LEN 7     // DATA? CR LF
+
+/***** Reply bytes per second over the bus time of the session *****/
+/*
+ * The bus time of a query is taken from its first byte to the last byte
+ * of the reply, as seen by the device.
+ */
+static double dataRate(const sim::Device &dev, size_t replyLen) {
+  const std::vector<uint64_t> &t = dev.byteTimes;
+  size_t n = QUERY_LEN + replyLen;
+  uint64_t busNs = 0;
+
+  CHECK(t.size() == NQUERIES * n);
+  for (size_t i = 0; i + n <= t.size(); i += n) busNs += t[i + n - 1] - t[i];
+  return NQUERIES * replyLen * 1e9 / busNs;
+}
+
+int main() {
+  sim::Device dev5(5), dev6(6);
+  std::shared_ptr<SimConn> a, b;
+  std::string data5(100, '5'), data6(100, '6');
+  size_t fromA, fromB;
+  uint64_t t;
+
+  dev5.idn = "DEVICE 5";
+  dev6.idn = "DEVICE 6";
+  dev5.replies["DATA?"] = data5;
+  dev6.replies["DATA?"] = data6;
+
+  boot();
+  a = connect();
+  b = connect();
+
+  // Each session has its own device and settings
+  run(*a, "++addr 5");
+  run(*a, "++tmbus 10");
+  run(*a, "++read_tmo_ms 50");
+  run(*b, "++addr 6");
+  run(*b, "++auto 2");
+  run("++addr 7");
+  for (SimConn *c : { a.get(), b.get() }) run(*c, "++eor 2");
+
+  CHECK(run(*a, "++addr") == "5\r\n");
+  CHECK(run(*b, "++addr") == "6\r\n");
+  CHECK(run("++addr") == "7\r\n");
+  CHECK(run(*a, "++tmbus") == "10\r\n");
+  CHECK(run(*b, "++tmbus") == "0\r\n");
+  CHECK(run(*a, "++read_tmo_ms") == "50\r\n");
+  CHECK(run(*b, "++read_tmo_ms") == "1200\r\n");
+
+  // Lines sent together by both clients: each one gets its own reply
+  a->in += "*IDN?\r++read\r";
+  b->in += "*IDN?\r";
+  fromA = a->out.size();
+  fromB = b->out.size();
+  settle();
+  CHECK(a->out.substr(fromA) == "DEVICE 5\n");
+  CHECK(b->out.substr(fromB) == "DEVICE 6\n");
+  CHECK(run(*a, "++tmbus") == "10\r\n");
+  CHECK(run(*b, "++tmbus") == "0\r\n");
+
+  // Both clients reading in turn
+  fromA = a->out.size();
+  fromB = b->out.size();
+  dev5.byteTimes.clear();
+  dev6.byteTimes.clear();
+  for (int i = 0; i < NQUERIES; i++) {
+    a->in += "DATA?\r++read\r";
+    b->in += "DATA?\r";
+  }
+  t = sim::now();
+  settle();
+  t = sim::now() - t;
+  CHECK(a->out.size() - fromA == NQUERIES * (data5.size() + 1));
+  CHECK(b->out.size() - fromB == NQUERIES * (data6.size() + 1));
+  CHECK(a->out.find('6', fromA) == std::string::npos);
+  CHECK(b->out.find('5', fromB) == std::string::npos);
+  printf("%d x 100 byte queries on 2 sessions, %.1f ms:\n", NQUERIES, t / 1e6);
+  printf("  session 1 (tmbus 10): %6.0f bytes/s\n", dataRate(dev5, data5.size() + 1));
+  printf("  session 2 (tmbus 0):  %6.0f bytes/s\n", dataRate(dev6, data6.size() + 1));
+
+  // A continuous read in one session does not hold the bus against the
+  // others: their lines are served between two reads
+  run(*a, "++auto 3");
+  a->in += "++read\r";
+  runFor(200);
+  fromA = Serial.out.size();
+  fromB = b->out.size();
+  Serial.in += "++addr\r";
+  b->in += "*IDN?\r";
+  sim::reset();
+  runFor(300);
+  CHECK(Serial.out.substr(fromA) == "7\r\n");
+  CHECK(b->out.substr(fromB) == "DEVICE 6\n");
+  CHECK(std::count_if(sim::cmdLog.begin(), sim::cmdLog.end(),
+                      [](const sim::Cmd &c) { return c.byte == GC_TAD + 5; }) >= 3);
+  run(*a, "++auto 0");
+  CHECK(run(*a, "++auto") == "0\r\n");
+
+  // A closed client frees its session, the others keep theirs
+  a->open = false;
+  settle();
+  CHECK(run(*b, "++addr") == "6\r\n");
+  CHECK(run("++addr") == "7\r\n");
+
+  return report("test_sessions");
+}
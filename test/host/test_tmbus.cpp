@@ -0,0 +1,65 @@
+/***** ++tmbus auto: calibrated bus delay of fast and slow devices *****/
+
+#include "harness.h"
+
+/***** Calibrate, check the result against the device, return tmbus *****/
+static unsigned calibrate(sim::Device &dev, uint8_t sa) {
+  std::string cmd = "++tmbus auto " + std::to_string(dev.pa);
+  std::string reply = dev.idn;
+  unsigned tmbus = 0;
+  unsigned long bps = 0;
+
+  if (sa) cmd += " " + std::to_string(sa);
+  CHECK(sscanf(run(cmd).c_str(), "%u %lu", &tmbus, &bps) == 2);
+  CHECK(bps > 0);
+
+  // The calibrated delay is applied by ++addr (device profile) and the
+  // device gets no garbled byte
+  run("++addr " + std::to_string(dev.pa) + (sa ? " " + std::to_string(sa) : ""));
+  CHECK(run("++tmbus") == std::to_string(tmbus) + "\r\n");
+  if (sa) reply += "," + std::to_string(sa);
+  dev.badBytes = 0;
+  dev.byteTimes.clear();
+  CHECK(run("*IDN?") == reply + "\n");
+  CHECK(dev.lines.back() == "*IDN?");
+  CHECK(dev.badBytes == 0);
+
+  printf("  device %u (%2u us between bytes): tmbus %3u, %6lu bytes/s\n",
+         dev.pa, dev.minGapUs, tmbus, bps);
+  return tmbus;
+}
+
+int main() {
+  sim::Device fast(6), slow(7), frame(8);
+  unsigned tm;
+
+  fast.idn = "FAST INSTRUMENTS,MODEL 1,0001,1.0";
+  slow.idn = "SLOW INSTRUMENTS,MODEL 2,0002,1.0";
+  slow.minGapUs = 12;
+  frame.idn = "MAINFRAME,MODEL 3,0003,1.0";
+  frame.sas = { 96 };
+  frame.minGapUs = 40;
+
+  boot();
+  run("++auto 2");
+  run("++eor 2");
+  run("++read_tmo_ms 100");
+
+  printf("calibration:\n");
+  CHECK(calibrate(fast, 0) == 0);
+  tm = calibrate(slow, 0);
+  CHECK((tm > 0) && (tm < 2 * slow.minGapUs));
+  tm = calibrate(frame, 96);
+  CHECK((tm > 0) && (tm < 2 * frame.minGapUs));
+
+  // Calibrating another device keeps the current one selected
+  run("++addr 6");
+  run("++tmbus auto 8 96");
+  CHECK(run("++addr") == "6\r\n");
+  CHECK(run("++tmbus") == "0\r\n");
+
+  // The address of the interface is not a device
+  CHECK(run("++tmbus auto 0") == "Unrecognized command\r\n");
+
+  return report("test_tmbus");
+}
@@ -0,0 +1,58 @@
+/***** Group trigger: one GET for all the devices vs one GET per device *****/
+
+#include "harness.h"
+
+#define NDEV 5
+
+static sim::Device *devs[NDEV];
+
+/***** Time between the first and the last device triggered *****/
+static double skewUs() {
+  uint64_t lo = UINT64_MAX, hi = 0;
+  for (sim::Device *d : devs) {
+    CHECK(d->triggers.size() == 1);
+    if (d->triggers.empty()) continue;
+    lo = std::min(lo, d->triggers.back());
+    hi = std::max(hi, d->triggers.back());
+    d->triggers.clear();
+  }
+  return (hi - lo) / 1000.0;
+}
+
+int main() {
+  for (uint8_t i = 0; i < NDEV; i++) devs[i] = new sim::Device(i + 1);
+
+  boot();
+  run("++addrcache 0");
+
+  for (uint16_t tmbus : { 0, 20 }) {
+    run("++tmbus " + std::to_string(tmbus));
+    printf("tmbus %u, %d devices:\n", tmbus, NDEV);
+
+    // Each device addressed, triggered and unaddressed in turn (the
+    // previous ++trg)
+    sim::reset();
+    for (sim::Device *d : devs) {
+      CHECK(gpib->addrDev(d->pa, 0, 0) == OK);
+      CHECK(gpib->gpibSendCmd(GC_GET) == OK);
+      CHECK(gpib->uaddrDev() == OK);
+    }
+    gpib->setGpibControls(CIDS);
+    printf("  GET per device: skew %7.2f us, %2zu command bytes\n", skewUs(), sim::cmdLog.size());
+
+    // ++trg: all listening, then one GET
+    sim::reset();
+    run("++trg 1 2 3 4 5");
+    printf("  ++trg:          skew %7.2f us, %2zu command bytes\n", skewUs(), sim::cmdLog.size());
+    for (sim::Device *d : devs) CHECK(!d->listening);
+  }
+
+  // Without parameter: only the device set with ++addr
+  run("++addr 3");
+  run("++trg");
+  for (sim::Device *d : devs) {
+    CHECK(d->triggers.size() == ((d->pa == 3) ? 1 : 0));
+  }
+
+  return report("test_trigger");
+}